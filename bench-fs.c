@@ -0,0 +1,441 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define _UTHREAD_PRIVATE
+#include <disk.h>
+#include <fatscan.h>
+#include <fs.h>
+#include <uthread.h>
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+#define bench_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)			\
+do {					\
+	bench_error(__VA_ARGS__);	\
+	exit(1);			\
+} while (0)
+
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *what, const char *backend, size_t blocks,
+		   double secs)
+{
+	printf("%-12s %-6s %8zu blocks %9.3f ms %9.1f MiB/s\n", what, backend,
+	       blocks, secs * 1e3,
+	       blocks * (double)BLOCK_SIZE / (1 << 20) / secs);
+}
+
+/*
+ * Time sequential and random single-block accesses, then whole-disk ranged
+ * accesses, on the currently open disk
+ */
+static void bench_backend(const char *backend, size_t bcount, int rounds)
+{
+	char *buf = malloc(bcount * BLOCK_SIZE);
+	size_t total = bcount * rounds;
+	double start;
+
+	if (!buf)
+		die("Cannot malloc");
+	memset(buf, 0xa5, bcount * BLOCK_SIZE);
+
+	start = now();
+	for (int r = 0; r < rounds; r++)
+		for (size_t b = 0; b < bcount; b++)
+			if (block_write(b, buf + b * BLOCK_SIZE))
+				die("block_write failed");
+	report("seq-write", backend, total, now() - start);
+
+	start = now();
+	for (int r = 0; r < rounds; r++)
+		for (size_t b = 0; b < bcount; b++)
+			if (block_read(b, buf + b * BLOCK_SIZE))
+				die("block_read failed");
+	report("seq-read", backend, total, now() - start);
+
+	srand(42);
+	start = now();
+	for (size_t i = 0; i < total; i++)
+		if (block_read(rand() % bcount, buf))
+			die("block_read failed");
+	report("rand-read", backend, total, now() - start);
+
+	start = now();
+	for (int r = 0; r < rounds; r++)
+		if (block_read_range(0, bcount, buf))
+			die("block_read_range failed");
+	report("range-read", backend, total, now() - start);
+
+	free(buf);
+}
+
+void bench_disk(int argc, char **argv)
+{
+	static const struct {
+		const char *name;
+		int flags;
+	} backends[] = {
+		{ "pread",	0 },
+		{ "mmap",	BLOCK_DISK_MMAP },
+	};
+	char *diskname;
+	size_t bcount;
+	int rounds = 8;
+
+	if (argc < 2)
+		die("need <scratch diskname> <block count> [<rounds>]");
+
+	diskname = argv[0];
+	bcount = strtoul(argv[1], NULL, 0);
+	if (argc > 2)
+		rounds = atoi(argv[2]);
+	if (!bcount || rounds <= 0)
+		die("invalid block count or rounds");
+
+	if (block_disk_create(diskname, bcount))
+		die("Cannot create scratch disk");
+
+	for (int i = 0; i < ARRAY_SIZE(backends); i++) {
+		if (block_disk_open_ex(diskname, backends[i].flags))
+			die("Cannot open disk");
+		bench_backend(backends[i].name, bcount, rounds);
+		if (block_disk_close())
+			die("Cannot close disk");
+	}
+}
+
+/* One file streamed by one thread */
+struct reader {
+	const char *filename;
+	size_t bytes;
+	unsigned long sum;
+};
+
+static struct {
+	char *diskname;
+	struct reader *readers;
+	int nreaders;
+	int running;
+} readers_arg;
+
+static void thread_reader(void *arg)
+{
+	struct reader *r = arg;
+	static char chunks[64][4 * BLOCK_SIZE];
+	char *buf = chunks[r - readers_arg.readers];
+	int fd, n;
+
+	if ((fd = fs_open(r->filename)) < 0)
+		die("Cannot open file '%s'", r->filename);
+
+	r->bytes = 0;
+	r->sum = 0;
+	while ((n = fs_read(fd, buf, sizeof(chunks[0]))) > 0) {
+		/* Some computation to overlap with the I/O of other readers */
+		for (int i = 0; i < n; i++)
+			r->sum = r->sum * 31 + (unsigned char)buf[i];
+		r->bytes += n;
+	}
+
+	fs_close(fd);
+	readers_arg.running--;
+}
+
+static void thread_readers(void *arg)
+{
+	static const struct {
+		const char *name;
+		int flags;
+	} modes[] = {
+		{ "sync",	0 },
+		{ "async",	FS_MOUNT_ASYNC },
+	};
+
+	for (int m = 0; m < ARRAY_SIZE(modes); m++) {
+		size_t total = 0;
+		unsigned long sum = 0;
+		double start;
+
+		fs_cache_config(0);
+		if (fs_mount_ex(readers_arg.diskname, modes[m].flags))
+			die("Cannot mount diskname");
+
+		start = now();
+		readers_arg.running = readers_arg.nreaders;
+		for (int i = 0; i < readers_arg.nreaders; i++)
+			if (uthread_create(thread_reader, &readers_arg.readers[i]))
+				die("Cannot create thread");
+		while (readers_arg.running)
+			uthread_yield();
+
+		for (int i = 0; i < readers_arg.nreaders; i++) {
+			total += readers_arg.readers[i].bytes;
+			sum = sum * 31 + readers_arg.readers[i].sum;
+		}
+		printf("%-6s %3d readers %10zu bytes %9.3f ms (sum %016lx)\n",
+		       modes[m].name, readers_arg.nreaders, total,
+		       (now() - start) * 1e3, sum);
+
+		if (fs_umount())
+			die("Cannot unmount diskname");
+	}
+}
+
+void bench_readers(int argc, char **argv)
+{
+	if (argc < 3)
+		die("need <diskname> <thread count> <filename>...");
+
+	readers_arg.diskname = argv[0];
+	readers_arg.nreaders = atoi(argv[1]);
+	if (readers_arg.nreaders <= 0 || readers_arg.nreaders > 64)
+		die("thread count must be between 1 and 64");
+
+	readers_arg.readers = calloc(readers_arg.nreaders, sizeof(struct reader));
+	if (!readers_arg.readers)
+		die("Cannot malloc");
+	/* Spread the files over the threads */
+	for (int i = 0; i < readers_arg.nreaders; i++)
+		readers_arg.readers[i].filename = argv[2 + i % (argc - 2)];
+
+	uthread_start(thread_readers, NULL);
+	free(readers_arg.readers);
+}
+
+/*
+ * Fill a FAT of @count entries like a used volume: files of a few blocks,
+ * chained in place, separated by free runs
+ */
+static void fill_fat(void *fat, int entry_size, size_t count)
+{
+	uint32_t eoc = entry_size == 2 ? UINT16_MAX : UINT32_MAX;
+	size_t i = 1;
+
+	memset(fat, 0, count * entry_size);
+	srand(42);
+	while (i < count) {
+		size_t used = 1 + rand() % 16, gap = rand() % 16;
+		for (; used && i < count; used--, i++) {
+			uint32_t next = used > 1 && i + 1 < count ? i + 1 : eoc;
+			if (entry_size == 2)
+				((uint16_t *)fat)[i] = next;
+			else
+				((uint32_t *)fat)[i] = next;
+		}
+		i += gap;
+	}
+	memset(fat, 0xff, entry_size);
+}
+
+/* Time both scans with every version of them the CPU supports */
+static void bench_fat_table(int entry_size, size_t count, int rounds)
+{
+	static const char *versions[] = { "scalar", "sse2", "avx2" };
+	void *fat = malloc(count * entry_size);
+	uint64_t *map = malloc((count + 63) / 64 * sizeof(uint64_t));
+	size_t ref_free = 0, ref_bad = 0;
+
+	if (!fat || !map)
+		die("Cannot malloc");
+	fill_fat(fat, entry_size, count);
+
+	for (int v = 0; v < ARRAY_SIZE(versions); v++) {
+		size_t nfree = 0, bad = 0;
+		double start, t_free, t_check;
+
+		if (fatscan_select(versions[v])) {
+			printf("fat%-2d %-6s unsupported\n", entry_size * 8, versions[v]);
+			continue;
+		}
+
+		start = now();
+		for (int r = 0; r < rounds; r++)
+			nfree = fatscan_free_map(fat, entry_size, count, map);
+		t_free = (now() - start) / rounds;
+
+		start = now();
+		for (int r = 0; r < rounds; r++)
+			bad = fatscan_find_invalid(fat, entry_size, count, count);
+		t_check = (now() - start) / rounds;
+
+		if (v == 0) {
+			ref_free = nfree;
+			ref_bad = bad;
+		} else if (nfree != ref_free || bad != ref_bad) {
+			die("%s disagrees with scalar", versions[v]);
+		}
+		printf("fat%-2d %-6s %9zu entries  free-map %8.1f us %7.2f GiB/s  "
+		       "check %8.1f us %7.2f GiB/s  (%zu free)\n",
+		       entry_size * 8, versions[v], count,
+		       t_free * 1e6, count * entry_size / t_free / (1 << 30),
+		       t_check * 1e6, count * entry_size / t_check / (1 << 30),
+		       nfree);
+	}
+	fatscan_select(NULL);
+
+	free(fat);
+	free(map);
+}
+
+void bench_fat(int argc, char **argv)
+{
+	/* Largest 16-bit volume: 65535 blocks, 32 of them for the FAT */
+	size_t fat16_entries = 65535 - 32 - 2;
+	size_t fat32_entries = 1 << 22;
+	int rounds = 200;
+
+	if (argc > 0)
+		rounds = atoi(argv[0]);
+	if (argc > 1)
+		fat32_entries = strtoul(argv[1], NULL, 0);
+	if (rounds <= 0 || !fat32_entries)
+		die("invalid rounds or entry count");
+
+	bench_fat_table(2, fat16_entries, rounds);
+	bench_fat_table(4, fat32_entries, rounds);
+}
+
+static struct {
+	char *diskname;
+	int nfiles;
+	int rounds;
+} tiny_arg;
+
+/*
+ * Fill a fresh volume with tiny files, then read them all back on a cold mount
+ * at every round
+ */
+static void bench_tiny_format(const char *what, int format_flags)
+{
+	struct fs_cache_stats stats;
+	size_t opens = 0, misses = 0;
+	char name[FS_FILENAME_LEN], data[24], buf[64];
+	double elapsed = 0, start;
+	int fd;
+
+	if (fs_format(tiny_arg.diskname, 1024, format_flags))
+		die("Cannot create diskname");
+	if (fs_mount(tiny_arg.diskname))
+		die("Cannot mount diskname");
+	for (int i = 0; i < tiny_arg.nfiles; i++) {
+		snprintf(name, sizeof(name), "tiny%d", i);
+		snprintf(data, sizeof(data), "file %d of %d", i, tiny_arg.nfiles);
+		if (fs_create(name) || (fd = fs_open(name)) < 0)
+			die("Cannot create file '%s'", name);
+		if (fs_write(fd, data, sizeof(data)) != sizeof(data))
+			die("Cannot write file '%s'", name);
+		fs_close(fd);
+	}
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	for (int r = 0; r < tiny_arg.rounds; r++) {
+		if (fs_mount(tiny_arg.diskname))
+			die("Cannot mount diskname");
+
+		start = now();
+		for (int i = 0; i < tiny_arg.nfiles; i++) {
+			snprintf(name, sizeof(name), "tiny%d", i);
+			if ((fd = fs_open(name)) < 0)
+				die("Cannot open file '%s'", name);
+			if (fs_read(fd, buf, sizeof(buf)) != sizeof(data))
+				die("Cannot read file '%s'", name);
+			fs_close(fd);
+			opens++;
+		}
+		elapsed += now() - start;
+
+		fs_cache_stats(&stats);
+		misses += stats.misses;
+		if (fs_umount())
+			die("Cannot unmount diskname");
+	}
+
+	printf("%-7s %6zu files read %9.3f ms %7.2f us/file %6zu data block reads\n",
+	       what, opens, elapsed * 1e3, elapsed * 1e6 / opens, misses);
+}
+
+static void thread_tiny(void *arg)
+{
+	bench_tiny_format("blocks", 0);
+	bench_tiny_format("inline", FS_FORMAT_INLINE);
+}
+
+void bench_tiny(int argc, char **argv)
+{
+	if (argc < 1)
+		die("need <scratch diskname> [<file count>] [<rounds>]");
+
+	tiny_arg.diskname = argv[0];
+	tiny_arg.nfiles = FS_FILE_MAX_COUNT;
+	tiny_arg.rounds = 32;
+	if (argc > 1)
+		tiny_arg.nfiles = atoi(argv[1]);
+	if (argc > 2)
+		tiny_arg.rounds = atoi(argv[2]);
+	if (tiny_arg.nfiles <= 0 || tiny_arg.nfiles > FS_FILE_MAX_COUNT ||
+	    tiny_arg.rounds <= 0)
+		die("file count must be between 1 and %d", FS_FILE_MAX_COUNT);
+
+	uthread_start(thread_tiny, NULL);
+}
+
+static struct {
+	const char *name;
+	void (*func)(int argc, char **argv);
+} commands[] = {
+	{ "disk",	bench_disk },
+	{ "readers",	bench_readers },
+	{ "fat",	bench_fat },
+	{ "tiny",	bench_tiny },
+};
+
+void usage(void)
+{
+	int i;
+	fprintf(stderr, "Usage: bench-fs <command> [<arg>]\n");
+	fprintf(stderr, "Possible commands are:\n");
+	for (i = 0; i < ARRAY_SIZE(commands); i++)
+		fprintf(stderr, "\t%s\n", commands[i].name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int i;
+	char *cmd;
+
+	/* Skip argv[0] */
+	argc--;
+	argv++;
+
+	if (!argc)
+		usage();
+
+	cmd = argv[0];
+
+	for (i = 0; i < ARRAY_SIZE(commands); i++) {
+		if (!strcmp(cmd, commands[i].name)) {
+			commands[i].func(argc - 1, &argv[1]);
+			break;
+		}
+	}
+	if (i == ARRAY_SIZE(commands)) {
+		bench_error("invalid command '%s'", cmd);
+		usage();
+	}
+
+	return 0;
+}
@@ -0,0 +1,519 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define _UTHREAD_PRIVATE
+#include "cache.h"
+#include "disk.h"
+#include "uthread.h"
+
+#define cache_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* End of an index-linked list */
+#define NIL -1
+
+/* Cached copy of one disk block */
+struct cache_entry {
+	/* Disk block held by this entry */
+	size_t block;
+	/* Entry holds a block, and that block differs from the disk */
+	int valid, dirty;
+	/* Entry contents are being written back */
+	int busy;
+	/* Entry was prefetched and has not been accessed since */
+	int prefetched;
+	/* LRU list, most recently used first */
+	int prev, next;
+	/* Hash bucket chain */
+	int hnext;
+};
+
+/* Block cache instance description */
+struct cache {
+	/* Set up by cache_init() */
+	int active;
+	/* Number of entries */
+	size_t nblocks;
+	/* Entries and their block contents (nblocks * BLOCK_SIZE bytes) */
+	struct cache_entry *entries;
+	char *data;
+	/* Hash table from block index to entry, power of two sized */
+	int *buckets;
+	size_t nbuckets;
+	/* LRU list ends */
+	int head, tail;
+	/* Bumped as uncached writes start and finish, and those in flight */
+	unsigned long write_gen;
+	int writes_in_flight;
+	struct cache_stats stats;
+};
+
+static struct cache cache;
+
+static size_t hash_block(size_t block)
+{
+	return (block * 2654435761u) & (cache.nbuckets - 1);
+}
+
+static void *entry_data(int e)
+{
+	return cache.data + (size_t)e * BLOCK_SIZE;
+}
+
+static void lru_unlink(int e)
+{
+	struct cache_entry *ent = &cache.entries[e];
+
+	if (ent->prev != NIL)
+		cache.entries[ent->prev].next = ent->next;
+	else
+		cache.head = ent->next;
+	if (ent->next != NIL)
+		cache.entries[ent->next].prev = ent->prev;
+	else
+		cache.tail = ent->prev;
+}
+
+static void lru_push_front(int e)
+{
+	struct cache_entry *ent = &cache.entries[e];
+
+	ent->prev = NIL;
+	ent->next = cache.head;
+	if (cache.head != NIL)
+		cache.entries[cache.head].prev = e;
+	cache.head = e;
+	if (cache.tail == NIL)
+		cache.tail = e;
+}
+
+static void lru_push_back(int e)
+{
+	struct cache_entry *ent = &cache.entries[e];
+
+	ent->next = NIL;
+	ent->prev = cache.tail;
+	if (cache.tail != NIL)
+		cache.entries[cache.tail].next = e;
+	cache.tail = e;
+	if (cache.head == NIL)
+		cache.head = e;
+}
+
+static void lru_touch(int e)
+{
+	if (cache.head == e)
+		return;
+	lru_unlink(e);
+	lru_push_front(e);
+}
+
+static int hash_lookup(size_t block)
+{
+	int e = cache.buckets[hash_block(block)];
+
+	while (e != NIL && cache.entries[e].block != block)
+		e = cache.entries[e].hnext;
+	return e;
+}
+
+static void hash_remove(int e)
+{
+	int *link = &cache.buckets[hash_block(cache.entries[e].block)];
+
+	while (*link != e)
+		link = &cache.entries[*link].hnext;
+	*link = cache.entries[e].hnext;
+}
+
+static void hash_insert(int e)
+{
+	int *bucket = &cache.buckets[hash_block(cache.entries[e].block)];
+
+	cache.entries[e].hnext = *bucket;
+	*bucket = e;
+}
+
+/*
+ * Disk transfers can park the calling uthread (see BLOCK_DISK_ASYNC), during
+ * which other threads may use the cache. Entries are therefore only rebound
+ * once no I/O remains to be done on them, and lookups are repeated after every
+ * transfer.
+ */
+static int write_back(int e)
+{
+	struct cache_entry *ent = &cache.entries[e];
+	int ret;
+
+	/* Never have two writes of the same entry in flight */
+	while (ent->busy)
+		uthread_yield();
+
+	if (!ent->dirty)
+		return 0;
+
+	/* Cleared first: a write landing meanwhile re-dirties the entry */
+	ent->dirty = 0;
+	ent->busy = 1;
+	ret = block_write(ent->block, entry_data(e));
+	ent->busy = 0;
+	if (ret < 0) {
+		ent->dirty = 1;
+		return -1;
+	}
+	cache.stats.writebacks++;
+	return 0;
+}
+
+/*
+ * Return the entry holding @block, creating it from the least recently used
+ * entry (written back first if needed) when it is not cached. @found tells
+ * which case happened. The entry is returned at the front of the LRU list.
+ */
+static int get_entry(size_t block, int *found)
+{
+	size_t skipped = 0;
+	int e;
+
+	for (;;) {
+		if ((e = hash_lookup(block)) != NIL) {
+			*found = 1;
+			lru_touch(e);
+			return e;
+		}
+
+		e = cache.tail;
+		if (!cache.entries[e].valid)
+			break;
+		if (cache.entries[e].busy) {
+			/* Give in-flight write-backs a chance to complete */
+			lru_touch(e);
+			if (++skipped >= cache.nblocks) {
+				uthread_yield();
+				skipped = 0;
+			}
+			continue;
+		}
+		if (!cache.entries[e].dirty) {
+			hash_remove(e);
+			cache.stats.evictions++;
+			if (cache.entries[e].prefetched)
+				cache.stats.prefetch_unused++;
+			break;
+		}
+		if (write_back(e) < 0)
+			return NIL;
+	}
+
+	*found = 0;
+	cache.entries[e].block = block;
+	cache.entries[e].valid = 1;
+	cache.entries[e].dirty = 0;
+	cache.entries[e].prefetched = 0;
+	hash_insert(e);
+	lru_touch(e);
+
+	return e;
+}
+
+/* Count an access to entry @e */
+static void touch_hit(int e)
+{
+	cache.stats.hits++;
+	if (cache.entries[e].prefetched) {
+		cache.entries[e].prefetched = 0;
+		cache.stats.prefetch_hits++;
+	}
+}
+
+/*
+ * cache_write_range() goes around the cache for blocks it does not hold, so a
+ * read started with write generation @gen may have fetched a block just before
+ * it was overwritten on disk. Its data may only be cached if no such write
+ * started, finished, or was in flight in the meantime.
+ */
+static int fill_ok(unsigned long gen)
+{
+	return gen == cache.write_gen && !cache.writes_in_flight;
+}
+
+/* Give the entry just bound by get_entry() back, it is first in line for reuse */
+static void drop_entry(int e)
+{
+	hash_remove(e);
+	cache.entries[e].valid = 0;
+	lru_unlink(e);
+	lru_push_back(e);
+}
+
+/* Keep a copy of @block freshly read from disk, unless a newer one exists */
+static int insert_clean(size_t block, void *buf, unsigned long gen)
+{
+	int found;
+	int e = get_entry(block, &found);
+
+	if (e == NIL)
+		return -1;
+	if (found)
+		memcpy(buf, entry_data(e), BLOCK_SIZE);
+	else if (fill_ok(gen))
+		memcpy(entry_data(e), buf, BLOCK_SIZE);
+	else
+		drop_entry(e);
+	return 0;
+}
+
+int cache_init(size_t nblocks)
+{
+	if (cache.active) {
+		cache_error("cache already initialized");
+		return -1;
+	}
+
+	memset(&cache, 0, sizeof(cache));
+	cache.nblocks = nblocks;
+	cache.head = cache.tail = NIL;
+
+	if (nblocks) {
+		cache.nbuckets = 1;
+		while (cache.nbuckets < 2 * nblocks)
+			cache.nbuckets <<= 1;
+
+		cache.entries = malloc(nblocks * sizeof(*cache.entries));
+		cache.data = malloc(nblocks * BLOCK_SIZE);
+		cache.buckets = malloc(cache.nbuckets * sizeof(*cache.buckets));
+		if (!cache.entries || !cache.data || !cache.buckets) {
+			cache_error("cannot allocate %zu blocks", nblocks);
+			free(cache.entries);
+			free(cache.data);
+			free(cache.buckets);
+			return -1;
+		}
+
+		for (size_t i = 0; i < cache.nbuckets; i++)
+			cache.buckets[i] = NIL;
+		for (size_t i = 0; i < nblocks; i++) {
+			cache.entries[i].valid = 0;
+			cache.entries[i].dirty = 0;
+			cache.entries[i].busy = 0;
+			cache.entries[i].prefetched = 0;
+			lru_push_front(i);
+		}
+	}
+
+	cache.active = 1;
+	return 0;
+}
+
+int cache_destroy(void)
+{
+	int ret;
+
+	if (!cache.active) {
+		cache_error("no cache currently initialized");
+		return -1;
+	}
+
+	ret = cache_flush();
+
+	free(cache.entries);
+	free(cache.data);
+	free(cache.buckets);
+	cache.active = 0;
+
+	return ret;
+}
+
+int cache_read(size_t block, void *buf)
+{
+	unsigned long gen;
+	int e;
+
+	if (!cache.nblocks)
+		return block_read(block, buf);
+
+	e = hash_lookup(block);
+	if (e != NIL) {
+		touch_hit(e);
+		lru_touch(e);
+		memcpy(buf, entry_data(e), BLOCK_SIZE);
+		return 0;
+	}
+
+	cache.stats.misses++;
+	gen = cache.write_gen;
+	if (block_read(block, buf) < 0)
+		return -1;
+
+	return insert_clean(block, buf, gen);
+}
+
+int cache_write(size_t block, const void *buf)
+{
+	int e, found;
+
+	if (!cache.nblocks)
+		return block_write(block, buf);
+
+	/* Whole block gets overwritten, no need to fetch it first */
+	if ((e = get_entry(block, &found)) == NIL)
+		return -1;
+	if (found)
+		touch_hit(e);
+	else
+		cache.stats.misses++;
+
+	memcpy(entry_data(e), buf, BLOCK_SIZE);
+	cache.entries[e].dirty = 1;
+
+	return 0;
+}
+
+int cache_read_range(size_t block, size_t count, void *buf)
+{
+	char *dst = buf;
+	size_t i = 0;
+
+	if (!cache.nblocks)
+		return block_read_range(block, count, buf);
+
+	while (i < count) {
+		size_t j = i;
+		unsigned long gen;
+		int e;
+
+		if ((e = hash_lookup(block + i)) != NIL) {
+			touch_hit(e);
+			lru_touch(e);
+			memcpy(dst + i * BLOCK_SIZE, entry_data(e), BLOCK_SIZE);
+			i++;
+			continue;
+		}
+
+		/* Fetch the whole run of missing blocks at once */
+		while (j < count && hash_lookup(block + j) == NIL)
+			j++;
+		gen = cache.write_gen;
+		if (block_read_range(block + i, j - i, dst + i * BLOCK_SIZE) < 0)
+			return -1;
+		cache.stats.misses += j - i;
+
+		/* Only the tail of a long run would survive in the cache */
+		for (size_t k = j - i > cache.nblocks ? j - cache.nblocks : i;
+		     k < j; k++)
+			if (insert_clean(block + k, dst + k * BLOCK_SIZE, gen) < 0)
+				return -1;
+		i = j;
+	}
+
+	return 0;
+}
+
+int cache_write_range(size_t block, size_t count, const void *buf)
+{
+	const char *src = buf;
+	int ret;
+
+	if (!cache.nblocks)
+		return block_write_range(block, count, buf);
+
+	for (size_t i = 0; i < count; i++) {
+		int e = hash_lookup(block + i);
+
+		if (e == NIL) {
+			cache.stats.misses++;
+			continue;
+		}
+		touch_hit(e);
+		lru_touch(e);
+		memcpy(entry_data(e), src + i * BLOCK_SIZE, BLOCK_SIZE);
+		/* A write-back in flight may carry a mix of old and new data */
+		cache.entries[e].dirty = cache.entries[e].busy;
+	}
+
+	/* Reads of the uncached blocks racing with this write must not be kept */
+	cache.write_gen++;
+	cache.writes_in_flight++;
+	ret = block_write_range(block, count, buf);
+	cache.writes_in_flight--;
+	cache.write_gen++;
+
+	return ret;
+}
+
+int cache_prefetch(size_t block, size_t count)
+{
+	size_t i = 0;
+
+	if (count > cache.nblocks / 2)
+		count = cache.nblocks / 2;
+
+	while (i < count) {
+		size_t j = i;
+		unsigned long gen;
+		char *buf;
+
+		if (hash_lookup(block + i) != NIL) {
+			i++;
+			continue;
+		}
+
+		/*
+		 * Read the run aside rather than into entries: other threads may
+		 * look the blocks up while this one is parked on the transfer
+		 */
+		while (j < count && hash_lookup(block + j) == NIL)
+			j++;
+		if (!(buf = malloc((j - i) * BLOCK_SIZE))) {
+			cache_error("cannot allocate %zu blocks", j - i);
+			return -1;
+		}
+		gen = cache.write_gen;
+		if (block_read_range(block + i, j - i, buf) < 0) {
+			free(buf);
+			return -1;
+		}
+
+		for (size_t k = i; k < j; k++) {
+			int found;
+			int e = get_entry(block + k, &found);
+
+			if (e == NIL) {
+				free(buf);
+				return -1;
+			}
+			/* Someone else brought the block in meanwhile */
+			if (found)
+				continue;
+			if (!fill_ok(gen)) {
+				drop_entry(e);
+				continue;
+			}
+			memcpy(entry_data(e), buf + (k - i) * BLOCK_SIZE,
+			       BLOCK_SIZE);
+			cache.entries[e].prefetched = 1;
+			cache.stats.prefetched++;
+		}
+		free(buf);
+		i = j;
+	}
+
+	return 0;
+}
+
+int cache_flush(void)
+{
+	int ret = 0;
+
+	for (size_t i = 0; i < cache.nblocks; i++)
+		if (cache.entries[i].valid && write_back(i) < 0)
+			ret = -1;
+
+	return ret;
+}
+
+void cache_get_stats(struct cache_stats *stats)
+{
+	*stats = cache.stats;
+}
@@ -0,0 +1,134 @@
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <stddef.h>
+
+#ifdef _UTHREAD_PRIVATE
+
+/** Number of blocks cached when no explicit size is configured */
+#define CACHE_DEFAULT_BLOCKS 64
+
+/*
+ * struct cache_stats - Block cache counters
+ * @hits: Number of block accesses served from memory
+ * @misses: Number of block accesses that had to go to disk
+ * @evictions: Number of cached blocks that were recycled for another block
+ * @writebacks: Number of dirty blocks written back to disk
+ * @prefetched: Number of blocks brought in by cache_prefetch()
+ * @prefetch_hits: Number of prefetched blocks later accessed
+ * @prefetch_unused: Number of prefetched blocks evicted without being accessed
+ */
+struct cache_stats {
+	size_t hits;
+	size_t misses;
+	size_t evictions;
+	size_t writebacks;
+	size_t prefetched;
+	size_t prefetch_hits;
+	size_t prefetch_unused;
+};
+
+/**
+ * cache_init - Set up the block cache
+ * @nblocks: Maximum number of blocks kept in memory
+ *
+ * Allocate a write-back, LRU-managed cache of @nblocks blocks in front of the
+ * currently open virtual disk. A cache of 0 blocks is valid and simply passes
+ * every access through to block_read() and block_write().
+ *
+ * Return: -1 if the cache is already set up or cannot be allocated. 0
+ * otherwise.
+ */
+int cache_init(size_t nblocks);
+
+/**
+ * cache_destroy - Flush and release the block cache
+ *
+ * Write back every dirty block and free the memory held by the cache.
+ *
+ * Return: -1 if the cache was not set up or if a dirty block cannot be written
+ * back. 0 otherwise.
+ */
+int cache_destroy(void);
+
+/**
+ * cache_read - Read a block through the cache
+ * @block: Index of the block to read from
+ * @buf: Data buffer to be filled with content of block
+ *
+ * Return: -1 if the block cannot be read from disk. 0 otherwise.
+ */
+int cache_read(size_t block, void *buf);
+
+/**
+ * cache_write - Write a block through the cache
+ * @block: Index of the block to write to
+ * @buf: Data buffer to write in the block
+ *
+ * The block is only marked dirty in memory; it reaches the disk when it gets
+ * evicted or when the cache is flushed.
+ *
+ * Return: -1 if a dirty block had to be evicted and could not be written back.
+ * 0 otherwise.
+ */
+int cache_write(size_t block, const void *buf);
+
+/**
+ * cache_read_range - Read consecutive blocks through the cache
+ * @block: Index of the first block to read from
+ * @count: Number of blocks to read
+ * @buf: Data buffer to be filled with content of the blocks
+ *
+ * Cached blocks are copied from memory; every run of uncached blocks is
+ * fetched with a single block_read_range() and then inserted in the cache.
+ *
+ * Return: -1 if the blocks cannot be read from disk. 0 otherwise.
+ */
+int cache_read_range(size_t block, size_t count, void *buf);
+
+/**
+ * cache_write_range - Write consecutive blocks through the cache
+ * @block: Index of the first block to write to
+ * @count: Number of blocks to write
+ * @buf: Data buffer to write in the blocks
+ *
+ * The whole range is written to disk with a single block_write_range(), and
+ * any cached copy of those blocks is refreshed and considered clean. Blocks
+ * read from disk while such a write is in flight are not cached.
+ *
+ * Return: -1 if the writing operation fails. 0 otherwise.
+ */
+int cache_write_range(size_t block, size_t count, const void *buf);
+
+/**
+ * cache_prefetch - Bring consecutive blocks into the cache ahead of use
+ * @block: Index of the first block to prefetch
+ * @count: Number of blocks to prefetch
+ *
+ * Every run of uncached blocks in the range is fetched with a single
+ * block_read_range(). At most half of the cache is filled by one call, so that
+ * a prefetch cannot push out everything else. Does nothing for a cache of 0
+ * blocks.
+ *
+ * Return: -1 if the blocks cannot be read from disk. 0 otherwise.
+ */
+int cache_prefetch(size_t block, size_t count);
+
+/**
+ * cache_flush - Write back all dirty blocks
+ *
+ * Return: -1 if a dirty block cannot be written back. 0 otherwise.
+ */
+int cache_flush(void);
+
+/**
+ * cache_get_stats - Get cache counters
+ * @stats: Structure to be filled with the current counters
+ */
+void cache_get_stats(struct cache_stats *stats);
+
+#else
+#error "Private header, can't be included from applications directly"
+#endif
+
+#endif /* _CACHE_H */
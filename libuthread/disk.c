@@ -1,12 +1,17 @@
 #include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #define _UTHREAD_PRIVATE
 #include "disk.h"
+#include "uring.h"
 
 #define block_error(fmt, ...) \
 	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
@@ -14,12 +19,24 @@
 /* Invalid file descriptor */
 #define INVALID_FD -1
 
+/* Most I/O vectors accepted by a single preadv()/pwritev() */
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/* Number of I/O vectors copied on the stack before resorting to malloc() */
+#define LOCAL_IOV 8
+
 /* Disk instance description */
 struct disk {
 	/* File descriptor */
 	int fd;
 	/* Block count */
 	size_t bcount;
+	/* Whole disk image when opened with %BLOCK_DISK_MMAP, NULL otherwise */
+	char *map;
+	/* Transfers go through the io_uring engine (%BLOCK_DISK_ASYNC) */
+	int async;
 };
 
 /* Currently open virtual disk (invalid by default) */
@@ -53,9 +70,15 @@ int block_disk_create(const char *diskname, size_t bcount)
 }
 
 int block_disk_open(const char *diskname)
+{
+	return block_disk_open_ex(diskname, 0);
+}
+
+int block_disk_open_ex(const char *diskname, int flags)
 {
 	int fd;
 	struct stat st;
+	char *map = NULL;
 
 	/* Parameter checking */
 	if (!diskname) {
@@ -84,8 +107,24 @@ int block_disk_open(const char *diskname)
 		return -1;
 	}
 
+	if ((flags & BLOCK_DISK_MMAP) && st.st_size) {
+		map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			   fd, 0);
+		if (map == MAP_FAILED) {
+			perror("mmap");
+			close(fd);
+			return -1;
+		}
+	}
+
+	/* Without a ring, quietly stay on synchronous I/O */
+	disk.async = 0;
+	if ((flags & BLOCK_DISK_ASYNC) && !map)
+		disk.async = uring_init(URING_ENTRIES) == 0;
+
 	disk.fd = fd;
 	disk.bcount = st.st_size / BLOCK_SIZE;
+	disk.map = map;
 
 	return 0;
 }
@@ -97,6 +136,18 @@ int block_disk_close(void)
 		return -1;
 	}
 
+	if (disk.map) {
+		if (msync(disk.map, disk.bcount * BLOCK_SIZE, MS_SYNC) < 0)
+			perror("msync");
+		munmap(disk.map, disk.bcount * BLOCK_SIZE);
+		disk.map = NULL;
+	}
+
+	if (disk.async) {
+		uring_exit();
+		disk.async = 0;
+	}
+
 	close(disk.fd);
 
 	disk.fd = INVALID_FD;
@@ -114,55 +165,164 @@ int block_disk_count(void)
 	return disk.bcount;
 }
 
-int block_write(size_t block, const void *buf)
+/* Check that blocks [@block, @block + @count) can be accessed */
+static int check_range(const char *func, size_t block, size_t count)
 {
 	if (disk.fd == INVALID_FD) {
-		block_error("no disk currently open");
+		fprintf(stderr, "%s: no disk currently open\n", func);
 		return -1;
 	}
 
-	if (block >= disk.bcount) {
-		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
+	if (block >= disk.bcount || count > disk.bcount - block) {
+		fprintf(stderr, "%s: block range out of bounds (%zu+%zu/%zu)\n",
+			func, block, count, disk.bcount);
 		return -1;
 	}
 
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
-		return -1;
+	return 0;
+}
+
+/*
+ * Perform a positional vectored transfer of @len bytes at byte offset @pos,
+ * resuming after short transfers. @iov is consumed in place.
+ */
+static int transfer_iov(int write_op, off_t pos, struct iovec *iov, int iovcnt,
+			size_t len)
+{
+	/* Mapped disk: plain copies from/to the page cache, no syscalls */
+	if (disk.map) {
+		for (int i = 0; i < iovcnt; i++) {
+			if (write_op)
+				memcpy(disk.map + pos, iov[i].iov_base,
+				       iov[i].iov_len);
+			else
+				memcpy(iov[i].iov_base, disk.map + pos,
+				       iov[i].iov_len);
+			pos += iov[i].iov_len;
+		}
+		return 0;
 	}
 
-	if (write(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("write");
-		return -1;
+	while (len) {
+		int cnt = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+		ssize_t ret;
+
+		if (disk.async)
+			ret = uring_rw(write_op, disk.fd, iov, cnt, pos);
+		else if (write_op)
+			ret = pwritev(disk.fd, iov, cnt, pos);
+		else
+			ret = preadv(disk.fd, iov, cnt, pos);
+		if (ret < 0) {
+			perror(write_op ? "pwritev" : "preadv");
+			return -1;
+		}
+		if (ret == 0) {
+			block_error("unexpected end of disk");
+			return -1;
+		}
+
+		pos += ret;
+		len -= ret;
+
+		/* Skip fully transferred vectors, trim the partial one */
+		while (iovcnt && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
 	}
 
 	return 0;
 }
 
-int block_read(size_t block, void *buf)
+/* Common part of block_readv() and block_writev() */
+static int block_iov(const char *func, int write_op, size_t block,
+		     const struct iovec *iov, int iovcnt)
 {
-	if (disk.fd == INVALID_FD) {
-		block_error("no disk currently open");
+	struct iovec local[LOCAL_IOV];
+	struct iovec *vec = local;
+	size_t len = 0;
+	int ret;
+
+	if (iovcnt <= 0) {
+		fprintf(stderr, "%s: invalid vector count %d\n", func, iovcnt);
 		return -1;
 	}
 
-	if (block >= disk.bcount) {
-		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
+	for (int i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	if (len % BLOCK_SIZE) {
+		fprintf(stderr, "%s: length '%zu' is not multiple of '%d'\n",
+			func, len, BLOCK_SIZE);
 		return -1;
 	}
 
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	if (check_range(func, block, len / BLOCK_SIZE))
 		return -1;
-	}
 
-	if (read(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("write");
+	/* transfer_iov() trims the vectors it is given, work on a copy */
+	if (iovcnt > LOCAL_IOV && !(vec = malloc(iovcnt * sizeof(*vec)))) {
+		perror("malloc");
 		return -1;
 	}
+	for (int i = 0; i < iovcnt; i++)
+		vec[i] = iov[i];
 
-	return 0;
+	ret = transfer_iov(write_op, (off_t)block * BLOCK_SIZE, vec, iovcnt,
+			   len);
+
+	if (vec != local)
+		free(vec);
+	return ret;
+}
+
+int block_write(size_t block, const void *buf)
+{
+	return block_write_range(block, 1, buf);
+}
+
+int block_read(size_t block, void *buf)
+{
+	return block_read_range(block, 1, buf);
+}
+
+int block_write_range(size_t block, size_t count, const void *buf)
+{
+	struct iovec iov = {
+		.iov_base = (void *)buf,
+		.iov_len = count * BLOCK_SIZE,
+	};
+
+	if (check_range(__func__, block, count))
+		return -1;
+
+	return transfer_iov(1, (off_t)block * BLOCK_SIZE, &iov, 1, iov.iov_len);
 }
 
+int block_read_range(size_t block, size_t count, void *buf)
+{
+	struct iovec iov = {
+		.iov_base = buf,
+		.iov_len = count * BLOCK_SIZE,
+	};
+
+	if (check_range(__func__, block, count))
+		return -1;
+
+	return transfer_iov(0, (off_t)block * BLOCK_SIZE, &iov, 1, iov.iov_len);
+}
+
+int block_writev(size_t block, const struct iovec *iov, int iovcnt)
+{
+	return block_iov(__func__, 1, block, iov, iovcnt);
+}
+
+int block_readv(size_t block, const struct iovec *iov, int iovcnt)
+{
+	return block_iov(__func__, 0, block, iov, iovcnt);
+}
@@ -2,6 +2,7 @@
 #define _DISK_H
 
 #include <stddef.h>
+#include <sys/uio.h>
 
 #ifdef _UTHREAD_PRIVATE
 
@@ -34,6 +35,33 @@ int block_disk_create(const char *diskname, size_t bcount);
  */
 int block_disk_open(const char *diskname);
 
+/** Access the virtual disk through a shared memory mapping */
+#define BLOCK_DISK_MMAP 0x1
+
+/** Issue block I/O through io_uring, parking the calling uthread meanwhile */
+#define BLOCK_DISK_ASYNC 0x2
+
+/**
+ * block_disk_open_ex - Open virtual disk file with a selected backend
+ * @diskname: Name of the virtual disk file
+ * @flags: Backend selection, 0, %BLOCK_DISK_MMAP or %BLOCK_DISK_ASYNC
+ *
+ * Same as block_disk_open(), but with %BLOCK_DISK_MMAP the whole virtual disk
+ * file is mapped in memory: block reads and writes become plain memory copies
+ * with no system call, and the mapping is synchronized back to the file with
+ * msync() by block_disk_close(). Without flags, blocks are accessed with
+ * positional reads and writes on the file descriptor.
+ *
+ * With %BLOCK_DISK_ASYNC, transfers are queued on an io_uring instance and the
+ * calling uthread is blocked until completion, so that other ready threads keep
+ * running and several requests can be in flight at once. If the kernel does
+ * not provide io_uring, the disk silently falls back to synchronous I/O.
+ *
+ * Return: -1 if @diskname is invalid, if the virtual disk file cannot be opened
+ * or mapped, or is already open. 0 otherwise.
+ */
+int block_disk_open_ex(const char *diskname, int flags);
+
 /**
  * block_disk_close - Close virtual disk file
  * @name: Name of the virtual disk file
@@ -76,6 +104,69 @@ int block_write(size_t block, const void *buf);
  */
 int block_read(size_t block, void *buf);
 
+/**
+ * block_write_range - Write consecutive blocks to disk
+ * @block: Index of the first block to write to
+ * @count: Number of blocks to write
+ * @buf: Data buffer to write in the blocks
+ *
+ * Write the content of buffer @buf (@count x %BLOCK_SIZE bytes) in the virtual
+ * disk's blocks @block to @block + @count - 1, using a single positional write
+ * whenever possible.
+ *
+ * Return: -1 if any block of the range is out of bounds or inaccessible or if
+ * the writing operation fails. 0 otherwise.
+ */
+int block_write_range(size_t block, size_t count, const void *buf);
+
+/**
+ * block_read_range - Read consecutive blocks from disk
+ * @block: Index of the first block to read from
+ * @count: Number of blocks to read
+ * @buf: Data buffer to be filled with content of the blocks
+ *
+ * Read the content of virtual disk's blocks @block to @block + @count - 1
+ * (@count x %BLOCK_SIZE bytes) into buffer @buf, using a single positional read
+ * whenever possible.
+ *
+ * Return: -1 if any block of the range is out of bounds or inaccessible, or if
+ * the reading operation fails. 0 otherwise.
+ */
+int block_read_range(size_t block, size_t count, void *buf);
+
+/**
+ * block_writev - Write consecutive blocks to disk from several buffers
+ * @block: Index of the first block to write to
+ * @iov: Array of buffers to gather the data from
+ * @iovcnt: Number of entries in @iov
+ *
+ * Gather the buffers described by @iov, in order, and write them to the blocks
+ * starting at @block with positional vectored I/O. Individual buffers may have
+ * any length, but their total length must be a multiple of %BLOCK_SIZE.
+ *
+ * Return: -1 if the total length is not a multiple of %BLOCK_SIZE, if any block
+ * of the range is out of bounds or inaccessible, or if the writing operation
+ * fails. 0 otherwise.
+ */
+int block_writev(size_t block, const struct iovec *iov, int iovcnt);
+
+/**
+ * block_readv - Read consecutive blocks from disk into several buffers
+ * @block: Index of the first block to read from
+ * @iov: Array of buffers to scatter the data into
+ * @iovcnt: Number of entries in @iov
+ *
+ * Read the blocks starting at @block with positional vectored I/O and scatter
+ * their content, in order, into the buffers described by @iov. Individual
+ * buffers may have any length, but their total length must be a multiple of
+ * %BLOCK_SIZE.
+ *
+ * Return: -1 if the total length is not a multiple of %BLOCK_SIZE, if any block
+ * of the range is out of bounds or inaccessible, or if the reading operation
+ * fails. 0 otherwise.
+ */
+int block_readv(size_t block, const struct iovec *iov, int iovcnt);
+
 #else
 #error "Private header, can't be included from applications directly"
 #endif
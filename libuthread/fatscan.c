@@ -0,0 +1,362 @@
+#include <stdint.h>
+#include <string.h>
+
+#define _UTHREAD_PRIVATE
+#include "fatscan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FATSCAN_X86
+#include <immintrin.h>
+#endif
+
+/* Entries covered by one bitmap word */
+#define WORD_BITS 64
+
+/* End of a chain, in the on-disk representation */
+#define EOC16 UINT16_MAX
+#define EOC32 UINT32_MAX
+
+/* One version of the scans */
+struct fatscan_ops {
+	const char *name;
+	int (*supported)(void);
+	size_t (*free_map)(const void *fat, int entry_size, size_t count,
+			   uint64_t *map);
+	size_t (*find_invalid)(const void *fat, int entry_size, size_t count,
+			       uint32_t limit);
+};
+
+/* Version in use, picked on first use */
+static const struct fatscan_ops *ops;
+
+static uint32_t entry(const void *fat, int entry_size, size_t i)
+{
+	if (entry_size == 2)
+		return ((const uint16_t *)fat)[i];
+	return ((const uint32_t *)fat)[i];
+}
+
+/*
+ * Scalar versions, also used by the vector ones for the entries past the last
+ * whole vector
+ */
+
+/* Fill in the bitmap words from the one holding entry @first */
+static size_t free_map_from(const void *fat, int entry_size, size_t first,
+			    size_t count, uint64_t *map)
+{
+	size_t nfree = 0;
+
+	if (first < count)
+		memset(map + first / WORD_BITS, 0,
+		       ((count + WORD_BITS - 1) / WORD_BITS - first / WORD_BITS)
+		       * sizeof(uint64_t));
+	for (size_t i = first; i < count; i++) {
+		if (entry(fat, entry_size, i) == 0) {
+			map[i / WORD_BITS] |= (uint64_t)1 << (i % WORD_BITS);
+			nfree++;
+		}
+	}
+	return nfree;
+}
+
+static size_t find_invalid_from(const void *fat, int entry_size, size_t first,
+				size_t count, uint32_t limit)
+{
+	uint32_t eoc = entry_size == 2 ? EOC16 : EOC32;
+
+	for (size_t i = first; i < count; i++) {
+		uint32_t value = entry(fat, entry_size, i);
+		if (value != eoc && value >= limit)
+			return i;
+	}
+	return count;
+}
+
+static int scalar_supported(void)
+{
+	return 1;
+}
+
+static size_t scalar_free_map(const void *fat, int entry_size, size_t count,
+			      uint64_t *map)
+{
+	return free_map_from(fat, entry_size, 0, count, map);
+}
+
+static size_t scalar_find_invalid(const void *fat, int entry_size, size_t count,
+				  uint32_t limit)
+{
+	return find_invalid_from(fat, entry_size, 0, count, limit);
+}
+
+#ifdef FATSCAN_X86
+
+/*
+ * SSE2 versions: 8 16-bit or 4 32-bit entries per compare. Compare results are
+ * narrowed to one byte per entry with saturating packs, so that one movemask
+ * yields the bits of 16 consecutive entries.
+ */
+
+static int sse2_supported(void)
+{
+	return __builtin_cpu_supports("sse2");
+}
+
+/* Free bits of the 16 entries at @p */
+__attribute__((target("sse2")))
+static inline unsigned sse2_free16(const uint16_t *p)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i a = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i *)p), zero);
+	__m128i b = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i *)p + 1), zero);
+
+	return _mm_movemask_epi8(_mm_packs_epi16(a, b));
+}
+
+__attribute__((target("sse2")))
+static inline unsigned sse2_free32(const uint32_t *p)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i *v = (const __m128i *)p;
+	__m128i a = _mm_cmpeq_epi32(_mm_loadu_si128(v), zero);
+	__m128i b = _mm_cmpeq_epi32(_mm_loadu_si128(v + 1), zero);
+	__m128i c = _mm_cmpeq_epi32(_mm_loadu_si128(v + 2), zero);
+	__m128i d = _mm_cmpeq_epi32(_mm_loadu_si128(v + 3), zero);
+
+	return _mm_movemask_epi8(_mm_packs_epi16(_mm_packs_epi32(a, b),
+						 _mm_packs_epi32(c, d)));
+}
+
+__attribute__((target("sse2")))
+static size_t sse2_free_map(const void *fat, int entry_size, size_t count,
+			    uint64_t *map)
+{
+	size_t words = count / WORD_BITS;
+	size_t nfree = 0;
+
+	for (size_t w = 0; w < words; w++) {
+		uint64_t bits = 0;
+		for (int k = 0; k < WORD_BITS / 16; k++) {
+			size_t i = w * WORD_BITS + k * 16;
+			unsigned m = entry_size == 2
+				? sse2_free16((const uint16_t *)fat + i)
+				: sse2_free32((const uint32_t *)fat + i);
+			bits |= (uint64_t)m << (k * 16);
+		}
+		map[w] = bits;
+		nfree += __builtin_popcountll(bits);
+	}
+	return nfree + free_map_from(fat, entry_size, words * WORD_BITS, count,
+				     map);
+}
+
+/*
+ * An entry is invalid when it is above limit - 1 without being the end of a
+ * chain. SSE2 has no unsigned compare: 16-bit entries use a saturating
+ * subtraction, 32-bit ones a signed compare with the sign bits flipped.
+ */
+__attribute__((target("sse2")))
+static size_t sse2_find_invalid(const void *fat, int entry_size, size_t count,
+				uint32_t limit)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i ones = _mm_set1_epi32(-1);
+	size_t i = 0;
+
+	if (limit == 0 || (entry_size == 2 && limit > EOC16))
+		return find_invalid_from(fat, entry_size, 0, count, limit);
+
+	if (entry_size == 2) {
+		const __m128i last = _mm_set1_epi16((short)(limit - 1));
+		for (; i + 16 <= count; i += 16) {
+			const __m128i *v = (const __m128i *)((const uint16_t *)fat + i);
+			__m128i a = _mm_loadu_si128(v);
+			__m128i b = _mm_loadu_si128(v + 1);
+			/* all ones for the entries that are fine */
+			__m128i ok_a = _mm_or_si128(_mm_cmpeq_epi16(_mm_subs_epu16(a, last), zero),
+						    _mm_cmpeq_epi16(a, ones));
+			__m128i ok_b = _mm_or_si128(_mm_cmpeq_epi16(_mm_subs_epu16(b, last), zero),
+						    _mm_cmpeq_epi16(b, ones));
+			if (_mm_movemask_epi8(_mm_and_si128(ok_a, ok_b)) != 0xFFFF)
+				break;
+		}
+	} else {
+		const __m128i sign = _mm_set1_epi32(INT32_MIN);
+		const __m128i last = _mm_xor_si128(_mm_set1_epi32(limit - 1), sign);
+		for (; i + 16 <= count; i += 16) {
+			const __m128i *v = (const __m128i *)((const uint32_t *)fat + i);
+			__m128i bad = zero;
+			for (int k = 0; k < 4; k++) {
+				__m128i x = _mm_loadu_si128(v + k);
+				__m128i above = _mm_cmpgt_epi32(_mm_xor_si128(x, sign), last);
+				bad = _mm_or_si128(bad, _mm_andnot_si128(_mm_cmpeq_epi32(x, ones), above));
+			}
+			if (_mm_movemask_epi8(bad))
+				break;
+		}
+	}
+	return find_invalid_from(fat, entry_size, i, count, limit);
+}
+
+/*
+ * AVX2 versions: twice as many entries per compare. The packs work within each
+ * 128-bit lane, so their results are put back in entry order with a cross-lane
+ * permutation before the movemask.
+ */
+
+static int avx2_supported(void)
+{
+	return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+}
+
+/* Free bits of the 32 entries at @p */
+__attribute__((target("avx2,popcnt")))
+static inline uint32_t avx2_free16(const uint16_t *p)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i a = _mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i *)p), zero);
+	__m256i b = _mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i *)p + 1), zero);
+	/* quadwords come out as a0-7 b0-7 a8-15 b8-15 */
+	__m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi16(a, b), 0xD8);
+
+	return _mm256_movemask_epi8(packed);
+}
+
+__attribute__((target("avx2,popcnt")))
+static inline uint32_t avx2_free32(const uint32_t *p)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i *v = (const __m256i *)p;
+	__m256i a = _mm256_cmpeq_epi32(_mm256_loadu_si256(v), zero);
+	__m256i b = _mm256_cmpeq_epi32(_mm256_loadu_si256(v + 1), zero);
+	__m256i c = _mm256_cmpeq_epi32(_mm256_loadu_si256(v + 2), zero);
+	__m256i d = _mm256_cmpeq_epi32(_mm256_loadu_si256(v + 3), zero);
+	/* doublewords come out as a0-3 b0-3 c0-3 d0-3 a4-7 b4-7 c4-7 d4-7 */
+	__m256i packed = _mm256_packs_epi16(_mm256_packs_epi32(a, b),
+					    _mm256_packs_epi32(c, d));
+	const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+	return _mm256_movemask_epi8(_mm256_permutevar8x32_epi32(packed, order));
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t avx2_free_map(const void *fat, int entry_size, size_t count,
+			    uint64_t *map)
+{
+	size_t words = count / WORD_BITS;
+	size_t nfree = 0;
+
+	for (size_t w = 0; w < words; w++) {
+		size_t i = w * WORD_BITS;
+		uint64_t bits;
+		if (entry_size == 2)
+			bits = avx2_free16((const uint16_t *)fat + i) |
+			       (uint64_t)avx2_free16((const uint16_t *)fat + i + 32) << 32;
+		else
+			bits = avx2_free32((const uint32_t *)fat + i) |
+			       (uint64_t)avx2_free32((const uint32_t *)fat + i + 32) << 32;
+		map[w] = bits;
+		nfree += __builtin_popcountll(bits);
+	}
+	return nfree + free_map_from(fat, entry_size, words * WORD_BITS, count,
+				     map);
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t avx2_find_invalid(const void *fat, int entry_size, size_t count,
+				uint32_t limit)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i ones = _mm256_set1_epi32(-1);
+	size_t i = 0;
+
+	if (limit == 0 || (entry_size == 2 && limit > EOC16))
+		return find_invalid_from(fat, entry_size, 0, count, limit);
+
+	if (entry_size == 2) {
+		const __m256i last = _mm256_set1_epi16((short)(limit - 1));
+		for (; i + 32 <= count; i += 32) {
+			const __m256i *v = (const __m256i *)((const uint16_t *)fat + i);
+			__m256i a = _mm256_loadu_si256(v);
+			__m256i b = _mm256_loadu_si256(v + 1);
+			__m256i ok_a = _mm256_or_si256(_mm256_cmpeq_epi16(_mm256_subs_epu16(a, last), zero),
+						       _mm256_cmpeq_epi16(a, ones));
+			__m256i ok_b = _mm256_or_si256(_mm256_cmpeq_epi16(_mm256_subs_epu16(b, last), zero),
+						       _mm256_cmpeq_epi16(b, ones));
+			if ((uint32_t)_mm256_movemask_epi8(_mm256_and_si256(ok_a, ok_b)) != UINT32_MAX)
+				break;
+		}
+	} else {
+		/* AVX2 has an unsigned max: an entry is below limit if max(x, limit - 1) is limit - 1 */
+		const __m256i last = _mm256_set1_epi32(limit - 1);
+		for (; i + 32 <= count; i += 32) {
+			const __m256i *v = (const __m256i *)((const uint32_t *)fat + i);
+			__m256i ok = ones;
+			for (int k = 0; k < 4; k++) {
+				__m256i x = _mm256_loadu_si256(v + k);
+				__m256i fine = _mm256_or_si256(_mm256_cmpeq_epi32(_mm256_max_epu32(x, last), last),
+							       _mm256_cmpeq_epi32(x, ones));
+				ok = _mm256_and_si256(ok, fine);
+			}
+			if ((uint32_t)_mm256_movemask_epi8(ok) != UINT32_MAX)
+				break;
+		}
+	}
+	return find_invalid_from(fat, entry_size, i, count, limit);
+}
+
+#endif /* FATSCAN_X86 */
+
+/* Known versions, slowest first */
+static const struct fatscan_ops all_ops[] = {
+	{ "scalar", scalar_supported, scalar_free_map, scalar_find_invalid },
+#ifdef FATSCAN_X86
+	{ "sse2", sse2_supported, sse2_free_map, sse2_find_invalid },
+	{ "avx2", avx2_supported, avx2_free_map, avx2_find_invalid },
+#endif
+};
+
+#define NUM_OPS (sizeof(all_ops) / sizeof(all_ops[0]))
+
+int fatscan_select(const char *name)
+{
+#ifdef FATSCAN_X86
+	__builtin_cpu_init();
+#endif
+	for (int i = NUM_OPS - 1; i >= 0; i--) {
+		if (name && strcmp(name, all_ops[i].name))
+			continue;
+		if (!all_ops[i].supported()) {
+			if (name)
+				return -1;
+			continue;
+		}
+		ops = &all_ops[i];
+		return 0;
+	}
+	return -1;
+}
+
+const char *fatscan_name(void)
+{
+	if (!ops)
+		fatscan_select(NULL);
+	return ops->name;
+}
+
+size_t fatscan_free_map(const void *fat, int entry_size, size_t count,
+			uint64_t *map)
+{
+	if (!ops)
+		fatscan_select(NULL);
+	return ops->free_map(fat, entry_size, count, map);
+}
+
+size_t fatscan_find_invalid(const void *fat, int entry_size, size_t count,
+			    uint32_t limit)
+{
+	if (!ops)
+		fatscan_select(NULL);
+	return ops->find_invalid(fat, entry_size, count, limit);
+}
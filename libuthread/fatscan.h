@@ -0,0 +1,63 @@
+#ifndef _FATSCAN_H
+#define _FATSCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef _UTHREAD_PRIVATE
+
+/*
+ * Whole-table scans of the FAT. Entries are 2 or 4 bytes wide, in the on-disk
+ * representation: 0 for a free block, all ones for the end of a chain. Each
+ * scan has a scalar, an SSE2 and an AVX2 version; the fastest one the CPU
+ * supports is picked on first use.
+ */
+
+/**
+ * fatscan_free_map - Build a free block bitmap
+ * @fat: FAT entries
+ * @entry_size: Size of an entry in bytes, 2 or 4
+ * @count: Number of entries to scan
+ * @map: Bitmap of (@count + 63) / 64 words
+ *
+ * Set bit i of @map (bit i % 64 of word i / 64) when entry i is free, and
+ * clear it otherwise. Bits past @count in the last word are cleared.
+ *
+ * Return: Number of free entries.
+ */
+size_t fatscan_free_map(const void *fat, int entry_size, size_t count,
+			uint64_t *map);
+
+/**
+ * fatscan_find_invalid - Look for an entry pointing outside of the table
+ * @fat: FAT entries
+ * @entry_size: Size of an entry in bytes, 2 or 4
+ * @count: Number of entries to scan
+ * @limit: Number of valid block indexes
+ *
+ * Return: Index of the first entry that is neither the end of a chain nor
+ * below @limit, or @count if there is none.
+ */
+size_t fatscan_find_invalid(const void *fat, int entry_size, size_t count,
+			    uint32_t limit);
+
+/**
+ * fatscan_select - Force a version of the scans
+ * @name: "scalar", "sse2" or "avx2", or NULL to go back to the fastest one
+ *
+ * Return: -1 if @name is unknown or not supported by the CPU. 0 otherwise.
+ */
+int fatscan_select(const char *name);
+
+/**
+ * fatscan_name - Version of the scans in use
+ *
+ * Return: "scalar", "sse2" or "avx2".
+ */
+const char *fatscan_name(void);
+
+#else
+#error "Private header, can't be included from applications directly"
+#endif
+
+#endif /* _FATSCAN_H */
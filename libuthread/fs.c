@@ -1,19 +1,24 @@
 #include <assert.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 
 #define _UTHREAD_PRIVATE
+#include "cache.h"
 #include "disk.h"
+#include "fatscan.h"
 #include "fs.h"
+#include "uthread.h"
 
 
 // Very nicely display "Function Source of error: the error message"
 #define fs_error(fmt, ...) \
 	fprintf(stderr, "%s: ERROR-"fmt"\n", __func__, ##__VA_ARGS__)
 
-#define EOC 0xFFFF
+// end of a chain, in memory; on disk it is the all-ones FAT entry
+#define EOC INT32_MAX
 #define EMPTY 0
 
 typedef enum { false, true } bool;
@@ -28,10 +33,28 @@ typedef enum { false, true } bool;
  * 0x0C		2-				Data block start index
  * 0x0E		2				Amount of data blocks
  * 0x10		1				Number of blocks for FAT
- * 0x11		4079			Unused/Padding
+ * 0x11		1				Format version
+ * 0x12		1				Features: bit 0 = inline data in the root directory,
+ *							bit 1 = file tails packed in fragment blocks
+ * 0x13		1				Unused/Padding
+ * 0x14		4				Total amount of blocks (version 1)
+ * 0x18		4				Root directory block index (version 1)
+ * 0x1C		4				Data block start index (version 1)
+ * 0x20		4				Amount of data blocks (version 1)
+ * 0x24		4				Number of blocks for FAT (version 1)
+ * 0x28		4056			Unused/Padding
  *
+ * Version 0 is the original format. Version 1 volumes use the 32-bit fields
+ * and 32-bit FAT entries, and leave the 16-bit fields at zero so that
+ * implementations that only know version 0 refuse them.
  */
 
+#define FORMAT_FAT16 0
+#define FORMAT_FAT32 1
+
+#define FEATURE_INLINE   0x1
+#define FEATURE_TAILPACK 0x2
+
 struct superblock_t {
     char     signature[8];
     uint16_t num_blocks;
@@ -39,18 +62,34 @@ struct superblock_t {
     uint16_t data_start_index;
     uint16_t num_data_blocks;
     uint8_t  num_FAT_blocks; 
-    uint8_t  unused[4079];
+    uint8_t  version;
+    uint8_t  features;
+    uint8_t  unused_1;
+    uint32_t num_blocks_32;
+    uint32_t root_dir_index_32;
+    uint32_t data_start_index_32;
+    uint32_t num_data_blocks_32;
+    uint32_t num_FAT_blocks_32;
+    uint8_t  unused[4056];
 } __attribute__((packed));
 
 
 /*
  * FAT:
- * The FAT is a flat array, possibly spanning several blocks, which entries are composed of 16-bit unsigned words. 
- * There are as many entries as data *blocks in the disk.
+ * The FAT is a flat array, possibly spanning several blocks, which entries are composed of 16-bit unsigned words
+ * (32-bit in version 1). There are as many entries as data *blocks in the disk.
 */
 
-struct FAT_t {
-	uint16_t words;
+
+// layout of the mounted volume, whatever its format version
+struct volume_t {
+	int num_blocks;
+	int root_dir_index;
+	int data_start_index;
+	int num_data_blocks;
+	int num_FAT_blocks;
+	int FAT_entry_size;   // bytes per FAT entry
+	bool inline_data;     // root directory widened by a block of inline data
 };
 
 
@@ -61,30 +100,291 @@ struct FAT_t {
  * 0x00		16				Filename (including NULL character)
  * 0x10		4				Size of the file (in bytes)
  * 0x14		2				Index of the first data block
- * 0x16		10				Unused/Padding
+ * 0x16		2				Index of the first data block, upper half (version 1)
+ * 0x18		1				Entry type: 0 = regular file, 1 = directory
+ * 0x19		4				Fragment block holding the last partial block, or 0
+ * 0x1D		2				Offset of the last partial block in the fragment block
+ * 0x1F		1				Flags: bit 0 = data inline in the entry
  *
+ * On a volume with the inline data feature, the root directory takes two
+ * blocks: the second one widens every entry with 32 bytes, at the same index,
+ * holding the whole content of a file of at most 32 bytes when the entry is
+ * flagged. Such a file has no data block.
  */
 
+#define ENTRY_FILE 0
+#define ENTRY_DIR  1
+
+#define ENTRY_INLINE 0x1
+
+#define INLINE_MAX_BYTES 32
+
 struct rootdirectory_t {
 	char     filename[FS_FILENAME_LEN];
 	uint32_t file_size;
 	uint16_t start_data_block;
-	uint8_t  unused[10];
+	uint16_t start_data_block_hi;
+	uint8_t  type;
+	uint32_t tail_block;
+	uint16_t tail_offset;
+	uint8_t  flags;
+} __attribute__((packed));
+
+
+/*
+ * Subdirectory:
+ * The entries of a subdirectory, in the root directory entry format, are kept
+ * in a B+tree of data blocks keyed on the file name. The directory's own entry
+ * points to the root node, which stays in place as the tree grows, and every
+ * node is a chain of a single block in the FAT. Nodes are not merged back
+ * when entries are removed.
+ *
+ * Offset	Length (bytes)	Description
+ * 0x00		2				Node type: 1 = leaf, 2 = internal
+ * 0x02		2				Number of entries (leaf) or keys (internal)
+ * 0x04		4				Leaf: next leaf in name order, 0 for the last one
+ *							Internal: child for the names below the first key
+ * 0x08		24				Unused/Padding
+ * 0x20		4064			Leaf: up to 127 entries, sorted by name
+ *							Internal: up to 203 keys, each a name followed by
+ *							the child for the names from it to the next key
+ *
+ */
+
+#define DIR_LEAF     1
+#define DIR_INTERNAL 2
+
+#define DIR_LEAF_MAX 127
+#define DIR_KEY_MAX  203
+
+struct dir_key_t {
+	char     name[FS_FILENAME_LEN];
+	uint32_t child;
+} __attribute__((packed));
+
+struct dir_node_t {
+	uint16_t type;
+	uint16_t num;
+	uint32_t link;
+	uint8_t  unused[24];
+	union {
+		struct rootdirectory_t entries[DIR_LEAF_MAX];
+		struct dir_key_t       keys[DIR_KEY_MAX];
+	};
 } __attribute__((packed));
 
+/*
+ * Fragment block:
+ * The partial last blocks (tails) of small files, packed together, in which
+ * case the file's chain only holds its whole blocks. The block is cut in 64
+ * units of 64 bytes: the first one starts with the 64-bit map of the units in
+ * use (its own bit included), and a tail takes a run of consecutive units. A
+ * fragment block is a chain of a single block in the FAT.
+ */
+
+#define FRAG_UNIT  64
+#define FRAG_UNITS (BLOCK_SIZE / FRAG_UNIT)
+
+// tails packed by FS_MOUNT_TAILPACK; larger ones waste less than half a block
+#define TAIL_MAX_BYTES (BLOCK_SIZE / 2)
+
 
+// directory handle: root node of a subdirectory, or ROOT_DIR for the root
+// directory (data block 0 is reserved, so no tree starts there)
+#define ROOT_DIR 0
+
+// a split adds at most one node per level, and with at least 63 entries per
+// leaf and 101 keys per internal node, 8 levels outnumber any disk's blocks
+#define DIR_MAX_DEPTH 8
+
+
+// descriptor: a position in an open file, whose shared state is in the open
+// file object it points to
 struct file_descriptor_t {
-    bool   is_used;       
-    int    file_index;              
+	struct open_file_t *file;  // NULL when the descriptor is free
+    int    file_index;         // slot of the open file
     size_t offset;  
-	char   file_name[FS_FILENAME_LEN];
+	int    next_free;          // next free descriptor while this one is free
+	// last block visited in the file's chain (logical position and FAT
+	// index), so sequential I/O resumes there instead of at the first block;
+	// cursor_fat_index is EOC until the first access
+	size_t cursor_block;
+	int    cursor_fat_index;
+	// FS_OPEN_* flags
+	int    flags;
+	// FS_OPEN_WBUF: bytes written at offsets [wbuf_off, wbuf_off + wbuf_len)
+	// not handed to the file yet, at most up to the end of wbuf_off's block
+	char  *wbuf;
+	size_t wbuf_off;
+	size_t wbuf_len;
+	// readahead: where a sequential read would start next, how many blocks
+	// to prefetch past each read (0 = not streaming), and the logical block
+	// up to which blocks were already prefetched
+	size_t ra_next_off;
+	size_t ra_window;
+	size_t ra_end;
+};
+
+
+// position in the list of buffers of a vectored transfer
+struct iov_iter {
+	const struct iovec *iov;    // current buffer
+	int                 iovcnt; // buffers left, current one included
+	size_t              skip;   // bytes of the current buffer already used
+};
+
+// logical-to-physical block map of a file, built for random access
+struct block_map_t {
+	size_t    num_blocks;
+	uint32_t *blocks;
 };
 
 
 struct superblock_t      *superblock;
 struct rootdirectory_t   *root_dir_block;
-struct FAT_t             *FAT_blocks;
-struct file_descriptor_t fd_table[FS_OPEN_MAX_COUNT]; 
+char                     (*root_inline)[INLINE_MAX_BYTES];
+struct volume_t          vol;
+uint8_t                  *FAT_blocks;
+
+// descriptor table, grown on demand: the descriptors themselves are allocated
+// in chunks and never move, so that a pointer to one stays valid across the
+// growth of the table. Free descriptors are chained from fd_free.
+static struct file_descriptor_t **fd_table;
+static int                        fd_table_size;
+static int                        fd_free = -1;
+
+// number of data blocks cached between the fs layer and the disk
+static size_t cache_blocks = CACHE_DEFAULT_BLOCKS;
+
+// one-block staging areas for the partial first and last blocks of a
+// transfer; one per call in progress, since asynchronous disk I/O parks the calling
+// thread in the middle of fs_read/fs_write
+static char *io_pool[FS_OPEN_MAX_COUNT];
+static int   io_pool_len;
+
+// FAT blocks read from disk so far; with FS_MOUNT_LAZY they are only read
+// the first time a chain walk or an allocation reaches them
+static bool *FAT_loaded;
+
+// metadata blocks changed since they were last written out: one flag per
+// FAT block, plus the root directory (the superblock only gains feature bits,
+// written out on the spot)
+static bool *FAT_dirty;
+static bool  root_dir_dirty;
+
+// name index over the root directory: open addressing with linear probing,
+// each slot holds a root directory index + 1 (0 = empty slot)
+#define NAME_HASH_SIZE (2 * FS_FILE_MAX_COUNT)
+
+static uint8_t name_hash[NAME_HASH_SIZE];
+static int     num_files;
+
+// files are designated by a slot: the root directory entries come first, then
+// the open files of subdirectories, as many slots as needed. An open file has
+// an object shared by all the descriptors on it and freed with the last one.
+// For a file of a subdirectory, it holds a copy of the entry that fs_sync()
+// and the last fs_close() write back to the directory.
+struct open_file_t {
+	int    refs;       // descriptors on the file
+	bool   dirty;      // entry changed since written back (subdirectory)
+	int    dir;        // directory holding the entry (subdirectory)
+	struct rootdirectory_t entry;  // (subdirectory)
+	struct block_map_t *block_map; // built for random access, or NULL
+};
+
+static struct open_file_t **open_files;  // one per slot, NULL if not open
+static int                  num_file_slots;
+
+// directory trees are being changed or walked; node I/O can park the thread
+// doing it, so other threads wait for their turn
+static bool dirs_busy;
+
+// directory listings (fs_opendir()): a subdirectory's walk resumes after the
+// last name it returned rather than at a leaf position, which splits move
+struct dir_stream_t {
+	bool is_used;
+	bool done;
+	int  dir;                    // ROOT_DIR or root node of the directory
+	int  pos;                    // root directory: next slot
+	char last[FS_FILENAME_LEN];  // subdirectory: last name returned, or ""
+};
+
+static struct dir_stream_t dir_streams[FS_OPEN_MAX_COUNT];
+
+// a jump of more than this many blocks ahead of the cursor is random access
+#define RANDOM_SEEK_BLOCKS 4
+
+// readahead window of a sequential stream: starts small and doubles with
+// every read that continues the stream, up to half the block cache
+#define RA_MIN_BLOCKS 4
+#define RA_MAX_BLOCKS 32
+
+static size_t ra_max_blocks;
+
+// delayed allocation (FS_MOUNT_DELALLOC): blocks appended to a file are kept
+// in memory, one slot per file slot, and only get disk blocks when
+// flushed. The file's chain stays first_block blocks long until then.
+struct staged_t {
+	size_t first_block;  // logical block held at the start of data
+	size_t num_blocks;
+	size_t max_blocks;   // room in data
+	bool   flushing;     // being written out, writers wait
+	char  *data;
+};
+
+// staged blocks of all files past which a write flushes them all
+#define DELALLOC_MAX_BLOCKS 1024
+
+static bool              delalloc;
+static struct staged_t **staged;  // one per file slot
+// staged blocks of all files, as many free blocks are kept for them
+static size_t            num_staged_blocks;
+
+// tail packing (FS_MOUNT_TAILPACK): fragment blocks known to have room left,
+// with their map of used units, found by packing or freeing tails since the
+// mount. Fragment blocks are changed by one thread at a time, and a file whose
+// tail is being packed cannot be opened meanwhile.
+#define FRAG_CACHE_SIZE 16
+
+struct frag_block_t {
+	int      block;
+	uint64_t used;
+};
+
+static bool                tailpack;
+static struct frag_block_t frag_blocks[FRAG_CACHE_SIZE];
+static int                 num_frag_blocks;
+static bool                frags_busy;
+static int                 packing_index = -1;
+
+// free data blocks: one bit per FAT entry (set = free), built from the whole
+// FAT when first needed and kept in sync with it, plus a running count of the
+// set bits
+static uint64_t *free_map;
+static int       free_map_words;
+static int       num_free_blocks;
+
+// free extents (maximal runs of free blocks), sorted by start block and also
+// threaded into lists bucketed by floor(log2(length)). Allocations shrink
+// extents in place; frees only mark the index stale, and it is rebuilt from
+// the bitmap by the next allocation.
+#define EXT_BUCKETS 32
+#define EXT_NIL     -1
+
+struct free_extent {
+	int start;
+	int len;
+	int prev;   // bucket list
+	int next;
+};
+
+static struct free_extent *extents;
+static int  num_extents;
+static int  ext_buckets[EXT_BUCKETS];
+static bool extents_valid;
+
+// next-fit cursor: where the last allocation ended
+static int  alloc_cursor;
 
 
 // private API
@@ -92,62 +392,302 @@ static bool error_free(const char *filename);
 static int  locate_file(const char* file_name);
 static bool is_open(const char* file_name);
 static int  locate_avail_fd();
+static int  grow_fd_table(void);
+static void release_fd(int fd);
+static struct file_descriptor_t *get_fd(int fd);
 static int  get_num_FAT_free_blocks();
+static int  build_free_map(void);
+static int  load_free_map(void);
+static int  load_FAT_blocks(int first, int count);
+static int  get_FAT(int fat_index);
+static int  alloc_extent(int goal, int want, int *got);
+static int  rebuild_extents(void);
+static void release_block(int fat_index);
+static void set_FAT(int fat_index, int value);
+static int  get_start_block(int file_index);
+static void set_start_block(int file_index, int block);
+static int  entry_start(const struct rootdirectory_t *the_dir);
+static void set_entry_start(struct rootdirectory_t *the_dir, int block);
+static struct rootdirectory_t *file_entry(int file_index);
+static void entry_dirty(int file_index);
+static uint32_t disk_EOC(void);
+static int  read_volume(void);
 static int  count_num_open_dir();
+static unsigned hash_name(const char *file_name);
+static void build_name_hash(void);
+static void name_hash_insert(int file_index);
+static void name_hash_remove(int file_index);
 static int  go_to_cur_FAT_block(int cur_fat_index, int iter_amount);
+static int  get_chain_tail(int fd, int *length);
+static int  seek_fd_block(int fd, size_t block);
+static void set_fd_cursor(int fd, size_t block, int fat_index);
+static struct block_map_t *build_block_map(int file_index);
+static void drop_block_map(int file_index);
+static int  contiguous_run(int fat_index, int max_blocks, int *next_index);
+static int  load_partial_block(char *dst, size_t block, int fat_index, size_t file_size);
+static int  read_iov(int fd, const struct iovec *iov, int iovcnt, size_t offset);
+static int  write_iov(int fd, const struct iovec *iov, int iovcnt, size_t offset);
+static size_t iov_length(const struct iovec *iov, int iovcnt);
+static size_t iov_contig(struct iov_iter *it, char **ptr);
+static void iov_advance(struct iov_iter *it, size_t len);
+static void iov_gather(struct iov_iter *it, char *dst, size_t len);
+static void iov_scatter(struct iov_iter *it, const char *src, size_t len);
+static int  read_run(int fat_index, size_t location, struct iov_iter *dst, size_t len,
+                     char *io_buff);
+static int  write_run(int fat_index, size_t block, size_t location, struct iov_iter *src,
+                      size_t len, size_t file_size, char *io_buff);
+static char *get_io_buff(void);
+static int  buffer_write(int fd, const char *buf, size_t count);
+static void update_readahead(int fd, size_t offset, size_t len);
+static int  extend_chain(int file_index, int tail, int chain_len, int needed);
+static size_t stage_blocks(int file_index, size_t chain_len, size_t needed);
+static int  flush_staged(int file_index);
+static int  flush_all_staged(void);
+static void readahead(int fd, size_t block, int fat_index);
+static int  flush_wbuf(int fd);
+static void put_io_buff(char *io_buff);
+static void lock_dirs(void);
+static void unlock_dirs(void);
+static int  resolve_path(const char *path, int *dir, char *name);
+static int  find_entry(int dir, const char *name, struct rootdirectory_t *entry, int *file_index);
+static int  create_entry(int dir, const char *name, int type, int start);
+static int  delete_entry(int dir, const char *name, int type);
+static int  sub_slot(int dir, const char *name);
+static int  get_file_slot(int dir, const char *name);
+static int  put_file_slot(int file_index);
+static int  write_sub_entries(void);
+static int  grow_file_slots(void);
+static int  dir_read(struct dir_stream_t *ds, struct fs_dirent *entries, int count);
+static void fill_dirent(struct fs_dirent *dirent, const struct rootdirectory_t *entry);
+static bool dir_listed(int dir);
+static void chain_frag_stats(int fat_index, struct fs_frag_stats *stats);
+static int  dir_frag_stats(int block, struct fs_frag_stats *stats);
+static int  read_node(int block, struct dir_node_t *node);
+static int  write_node(int block, const struct dir_node_t *node);
+static int  alloc_node(int goal);
+static int  leaf_find(const struct dir_node_t *node, const char *name, bool *found);
+static int  node_child(const struct dir_node_t *node, const char *name, int *pos);
+static int  dir_descend(int dir, const char *name, struct dir_node_t *node);
+static int  dir_lookup(int dir, const char *name, struct rootdirectory_t *entry);
+static int  dir_update(int dir, const struct rootdirectory_t *entry);
+static int  dir_remove(int dir, const char *name);
+static int  dir_insert(int dir, const struct rootdirectory_t *entry);
+static int  node_insert(int block, const struct rootdirectory_t *entry, char *sep, int *new_block);
+static void leaf_put(struct dir_node_t *node, int pos, const struct rootdirectory_t *entry);
+static void key_put(struct dir_node_t *node, int pos, const char *name, int child);
+static int  dir_empty(int dir);
+static int  free_dir_tree(int block);
+static int  set_feature(uint8_t feature);
+static int  pack_tail(int file_index);
+static int  unpack_tail(int file_index);
+static int  frag_store(const char *data, size_t len, int *block, int *offset);
+static int  frag_free(int block, int offset, size_t len);
+static void frag_remember(int block, uint64_t used);
+static void lock_frags(void);
+static void unlock_frags(void);
+static bool can_inline(int file_index);
+static int  spill_inline(int file_index);
+
+
+// Creates a virtual disk holding an empty file system
+int fs_format(const char *diskname, size_t data_blocks, int flags) {
+
+	int entry_size = (flags & FS_FORMAT_FAT32) ? 4 : 2;
+	size_t max_blocks = (flags & FS_FORMAT_FAT32) ? INT32_MAX : UINT16_MAX;
+
+	// superblock, FAT, root directory and data blocks
+	size_t num_FAT_blocks = (data_blocks * entry_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	size_t root_dir_blocks = (flags & FS_FORMAT_INLINE) ? 2 : 1;
+	size_t num_blocks = num_FAT_blocks + 1 + root_dir_blocks + data_blocks;
+
+	// the virtual disk layer only has one disk open at a time
+	if(superblock) {
+		fs_error("a file system is already mounted \n");
+		return -1;
+	}
+	if(data_blocks == 0 || data_blocks > max_blocks || num_blocks > max_blocks ||
+	   (!(flags & FS_FORMAT_FAT32) && num_FAT_blocks > UINT8_MAX)) {
+		fs_error("invalid number of data blocks \n");
+		return -1;
+	}
+
+	struct superblock_t *sb = calloc(1, BLOCK_SIZE);
+	uint8_t *fat = calloc(1, BLOCK_SIZE);
+	if(!sb || !fat) {
+		free(sb);
+		free(fat);
+		return -1;
+	}
+
+	memcpy(sb->signature, "ECS150FS", 8);
+	if(flags & FS_FORMAT_FAT32) {
+		sb->version             = FORMAT_FAT32;
+		sb->num_blocks_32       = num_blocks;
+		sb->num_FAT_blocks_32   = num_FAT_blocks;
+		sb->root_dir_index_32   = num_FAT_blocks + 1;
+		sb->data_start_index_32 = num_FAT_blocks + 1 + root_dir_blocks;
+		sb->num_data_blocks_32  = data_blocks;
+	} else {
+		sb->version             = FORMAT_FAT16;
+		sb->num_blocks          = num_blocks;
+		sb->num_FAT_blocks      = num_FAT_blocks;
+		sb->root_dir_index      = num_FAT_blocks + 1;
+		sb->data_start_index    = num_FAT_blocks + 1 + root_dir_blocks;
+		sb->num_data_blocks     = data_blocks;
+	}
+	if(flags & FS_FORMAT_INLINE)
+		sb->features = FEATURE_INLINE;
+
+	// the first data block is never handed out
+	memset(fat, 0xFF, entry_size);
+
+	// blocks left untouched read back as zeroes: free FAT entries, empty root directory
+	int ret = -1;
+	if(block_disk_create(diskname, num_blocks) == 0 && block_disk_open(diskname) == 0) {
+		if(block_write(0, sb) == 0 && block_write(1, fat) == 0)
+			ret = 0;
+		if(block_disk_close() < 0)
+			ret = -1;
+	}
+	if(ret < 0)
+		fs_error("cannot create virtual disk \n");
+
+	free(sb);
+	free(fat);
+	return ret;
+}
 
 
 // Makes the file system contained in the specified virtual disk "ready to be used"
 int fs_mount(const char *diskname) {
+	return fs_mount_ex(diskname, 0);
+}
 
-	superblock = malloc(BLOCK_SIZE);
+
+int fs_mount_ex(const char *diskname, int flags) {
+
+	if(superblock) {
+		fs_error("a file system is already mounted \n");
+		return -1;
+	}
 
 	// open disk dd
-	if(block_disk_open(diskname) < 0){
+	int disk_flags = 0;
+	if(flags & FS_MOUNT_MMAP)
+		disk_flags |= BLOCK_DISK_MMAP;
+	if(flags & FS_MOUNT_ASYNC)
+		disk_flags |= BLOCK_DISK_ASYNC;
+
+	if(block_disk_open_ex(diskname, disk_flags) < 0){
 		fs_error("failure to open virtual disk \n");
 		return -1;
 	}
 	
+	// set up the data block cache in front of the disk (a mapped disk
+	// already lives in memory)
+	size_t nblocks = (flags & FS_MOUNT_MMAP) ? 0 : cache_blocks;
+	if(cache_init(nblocks) < 0){
+		fs_error("failure to set up block cache \n");
+		block_disk_close();
+		return -1;
+	}
+	ra_max_blocks = nblocks / 2 < RA_MAX_BLOCKS ? nblocks / 2 : RA_MAX_BLOCKS;
+
+	delalloc = (flags & FS_MOUNT_DELALLOC) != 0;
+	tailpack = (flags & FS_MOUNT_TAILPACK) != 0;
+	num_frag_blocks = 0;
+	num_staged_blocks = 0;
+
 	// initialize data onto local super block 
-	if(block_read(0, (void*)superblock) < 0){
+	superblock = malloc(BLOCK_SIZE);
+	if(!superblock || block_read(0, (void*)superblock) < 0){
 		fs_error( "failure to read from block \n");
-		return -1;
+		goto err;
 	}
 	// check for correct signature
 	if(strncmp(superblock->signature, "ECS150FS", 8) != 0){
 		fs_error( "invalid disk signature \n");
-		return -1;
+		goto err;
 	}
+	// layout of the volume, depending on the format version
+	if(read_volume() < 0)
+		goto err;
 	// check for correct number of blocks on disk
-	if(superblock->num_blocks != block_disk_count()) {
+	if(vol.num_blocks != block_disk_count()) {
 		fs_error("incorrect block disk count \n");
-		return -1;
+		goto err;
 	}
 
-	// initialize data onto local FAT blocks
-	FAT_blocks = malloc(superblock->num_FAT_blocks * BLOCK_SIZE);
-	for(int i = 0; i < superblock->num_FAT_blocks; i++) {
-		// read each fat block in the disk starting at position 1
-		if(block_read(i + 1, (void*)FAT_blocks + (i * BLOCK_SIZE)) < 0) {
-			fs_error("failure to read from block \n");
-			return -1;
-		}
+	// room for the FAT blocks, read in below or on first use
+	FAT_blocks = malloc((size_t)vol.num_FAT_blocks * BLOCK_SIZE);
+	FAT_loaded = calloc(vol.num_FAT_blocks, sizeof(bool));
+
+	// nothing to write back yet
+	FAT_dirty = calloc(vol.num_FAT_blocks, sizeof(bool));
+	root_dir_dirty = false;
+	if(!FAT_blocks || !FAT_loaded || !FAT_dirty) {
+		fs_error("failure to allocate FAT \n");
+		goto err;
+	}
+
+	// read the whole FAT and index the free data blocks
+	if(!(flags & FS_MOUNT_LAZY) && load_free_map() < 0) {
+		fs_error("failure to load FAT \n");
+		goto err;
 	}
 
-	// initialize data onto local root directory block
-	root_dir_block = malloc(sizeof(struct rootdirectory_t) * FS_FILE_MAX_COUNT);
+	// initialize data onto local root directory block, followed by the inline
+	// data of its entries
+	int root_dir_blocks = vol.inline_data ? 2 : 1;
+	root_dir_block = malloc((size_t)BLOCK_SIZE * root_dir_blocks);
+	root_inline = vol.inline_data ? (void *)((char *)root_dir_block + BLOCK_SIZE) : NULL;
 	// read the root directory block in the disk starting after the last FAT block
-	if(block_read(superblock->num_FAT_blocks + 1, (void*)root_dir_block) < 0) { 
+	if(!root_dir_block ||
+	   block_read_range(vol.root_dir_index, root_dir_blocks, (void*)root_dir_block) < 0) { 
 		fs_error("failure to read from block \n");
-		return -1;
+		goto err;
 	}
 	
-	// initialize file descriptors 
-    for(int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-		fd_table[i].is_used = false;
+	// index the file names
+	build_name_hash();
+
+	// no file open yet, the descriptor table grows with the first open
+	num_file_slots = FS_FILE_MAX_COUNT + FS_OPEN_MAX_COUNT;
+	open_files = calloc(num_file_slots, sizeof(struct open_file_t *));
+	staged = calloc(num_file_slots, sizeof(struct staged_t *));
+	fd_table_size = 0;
+	fd_free = -1;
+	if(!open_files || !staged) {
+		fs_error("failure to allocate open file table \n");
+		goto err;
 	}
         
 	return 0;
+
+	// undo everything set up so far, the next mount starts from scratch
+err:
+	free(open_files);
+	free(staged);
+	open_files = NULL;
+	staged = NULL;
+	free(root_dir_block);
+	root_dir_block = NULL;
+	root_inline = NULL;
+	free(FAT_blocks);
+	free(FAT_loaded);
+	free(FAT_dirty);
+	FAT_blocks = NULL;
+	FAT_loaded = NULL;
+	FAT_dirty = NULL;
+	free(free_map);
+	free(extents);
+	free_map = NULL;
+	extents = NULL;
+	free(superblock);
+	superblock = NULL;
+	cache_destroy();
+	block_disk_close();
+	return -1;
 }
 
 
@@ -159,84 +699,175 @@ int fs_umount(void) {
 		return -1;
 	}
 
-	if(block_write(0, (void*)superblock) < 0) {
-		fs_error("failure to write to block \n");
+	if(fs_sync() < 0)
 		return -1;
-	}
 
-	for(int i = 0; i < superblock->num_FAT_blocks; i++) {
-		if(block_write(i + 1, (void*)FAT_blocks + (i * BLOCK_SIZE)) < 0) {
-			fs_error("failure to write to block \n");
-			return -1;
-		}
+	if(cache_destroy() < 0) {
+		fs_error("failure to flush block cache \n");
+		return -1;
 	}
 
-	if(block_write(superblock->num_FAT_blocks + 1, (void*)root_dir_block) < 0) {
-		fs_error("failure to write to block \n");
-			return -1;
+	for(int i = 0; i < num_file_slots; i++) {
+		drop_block_map(i);
+		free(open_files[i]);
 	}
+	free(open_files);
+	free(staged);
+	open_files = NULL;
+	staged = NULL;
+	memset(dir_streams, 0, sizeof(dir_streams));
 
 	free(superblock);
 	free(root_dir_block);
+	root_inline = NULL;
 	free(FAT_blocks);
-
-	// reset file descriptors
-    for(int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-		fd_table[i].offset = 0;
-		fd_table[i].is_used = false;
-		fd_table[i].file_index = -1;
-		memset(fd_table[i].file_name, 0, FS_FILENAME_LEN);
-    }
+	free(FAT_loaded);
+	free(FAT_dirty);
+	free(free_map);
+	free(extents);
+	free_map = NULL;
+	extents = NULL;
+	while(io_pool_len > 0)
+		free(io_pool[--io_pool_len]);
+	superblock = NULL;
+
+	// release file descriptors, chunk by chunk
+    for(int i = 0; i < fd_table_size; i++)
+		free(fd_table[i]->wbuf);
+	for(int i = 0; i < fd_table_size; i = i ? 2 * i : FS_OPEN_MAX_COUNT)
+		free(fd_table[i]);
+	free(fd_table);
+	fd_table = NULL;
+	fd_table_size = 0;
+	fd_free = -1;
 
 	block_disk_close();
 	return 0;
 }
 
 
+// Write out the metadata blocks that changed, after the data they reference
+int fs_sync(void) {
+
+	if(!superblock){
+		fs_error("No disk available to sync\n");
+		return -1;
+	}
+
+	// buffered writes first, they may grow files
+	int ret = 0;
+	for(int fd = 0; fd < fd_table_size; fd++)
+		if(fd_table[fd]->file && flush_wbuf(fd) < 0)
+			ret = -1;
+
+	// then give delayed blocks their place on disk
+	if(flush_all_staged() < 0)
+		ret = -1;
+
+	// entries of open files in subdirectories go back to their directory
+	lock_dirs();
+	if(write_sub_entries() < 0)
+		ret = -1;
+	unlock_dirs();
+
+	if(cache_flush() < 0) {
+		fs_error("failure to flush block cache \n");
+		return -1;
+	}
+
+	// one request per run of consecutive dirty FAT blocks
+	for(int i = 0; i < vol.num_FAT_blocks; i++) {
+		if(!FAT_dirty[i])
+			continue;
+		int j = i;
+		while(j < vol.num_FAT_blocks && FAT_dirty[j])
+			j++;
+		if(block_write_range(i + 1, j - i, FAT_blocks + (size_t)i * BLOCK_SIZE) < 0) {
+			fs_error("failure to write to block \n");
+			return -1;
+		}
+		while(i < j)
+			FAT_dirty[i++] = false;
+	}
+
+	if(root_dir_dirty) {
+		if(block_write_range(vol.root_dir_index, vol.inline_data ? 2 : 1, (void*)root_dir_block) < 0) {
+			fs_error("failure to write to block \n");
+			return -1;
+		}
+		root_dir_dirty = false;
+	}
+
+	return ret;
+}
+
+
 // Display some information about the currently mounted file system.
 int fs_info(void) {
 
+	struct fs_volume_stats stats;
+	if(fs_volume_stats(&stats) < 0)
+		return -1;
+
 	printf("FS Info:\n");
-	printf("total_blk_count=%d\n", superblock->num_blocks);
-	printf("fat_blk_count=%d\n", superblock->num_FAT_blocks);
-	printf("rdir_blk=%d\n", superblock->num_FAT_blocks + 1);
-	printf("data_blk=%d\n", superblock->num_FAT_blocks + 2);
-	printf("data_blk_count=%d\n", superblock->num_data_blocks);
-	printf("fat_free_ratio=%d/%d\n", get_num_FAT_free_blocks(), superblock->num_data_blocks);
-	printf("rdir_free_ratio=%d/128\n", count_num_open_dir());
+	printf("total_blk_count=%zu\n", stats.total_blocks);
+	printf("fat_blk_count=%zu\n", stats.fat_blocks);
+	printf("rdir_blk=%zu\n", stats.root_dir_block);
+	printf("data_blk=%zu\n", stats.data_start);
+	printf("data_blk_count=%zu\n", stats.data_blocks);
+	printf("fat_free_ratio=%zu/%zu\n", stats.free_blocks, stats.data_blocks);
+	printf("rdir_free_ratio=%zu/%d\n", stats.free_root_entries, FS_FILE_MAX_COUNT);
+
+	return 0;
+}
+
+
+// The figures of fs_info(), for programs rather than people
+int fs_volume_stats(struct fs_volume_stats *stats) {
+
+	if(!superblock || !stats) {
+		fs_error("no disk mounted or no stats structure supplied");
+		return -1;
+	}
+
+	int free_blocks = get_num_FAT_free_blocks();
+	if(free_blocks < 0) {
+		fs_error("failure to load FAT");
+		return -1;
+	}
 
+	stats->total_blocks      = vol.num_blocks;
+	stats->fat_blocks        = vol.num_FAT_blocks;
+	stats->root_dir_block    = vol.root_dir_index;
+	stats->data_start        = vol.data_start_index;
+	stats->data_blocks       = vol.num_data_blocks;
+	stats->free_blocks       = free_blocks;
+	stats->free_root_entries = count_num_open_dir();
 	return 0;
 }
 
 
 /*
 Create a new file:
-	0. Make sure we don't duplicate files, by checking for existings.
-	1. Find an empty entry in the root directory.
-	2. The name needs to be set, and all other information needs to get reset.
-		2.2 Intitially the size is 0 and pointer to first data block is FAT_EOC.
+	0. Find the directory the file goes in.
+	1. Make sure we don't duplicate files, by checking for existings.
+	2. Find an empty entry in the root directory, or insert one in the
+	   subdirectory's tree.
+	3. The name needs to be set, and all other information needs to get reset.
+		3.2 Intitially the size is 0 and pointer to first data block is FAT_EOC.
 */
 int fs_create(const char *filename) {
 
-	// perform error checking first 
-	if(error_free(filename) == false) {
-		fs_error("error associated with filename");
-		return -1;
-	}
-
-	// finds first available empty file
-	for(int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if(root_dir_block[i].filename[0] == EMPTY) {	
+	char name[FS_FILENAME_LEN];
+	int dir;
 
-			// initialize file data 
-			strcpy(root_dir_block[i].filename, filename);
-			root_dir_block[i].file_size     = 0;
-			root_dir_block[i].start_data_block = EOC;
+	lock_dirs();
+	int ret = resolve_path(filename, &dir, name);
+	if(ret == 0)
+		ret = create_entry(dir, name, ENTRY_FILE, EOC);
+	unlock_dirs();
 
-			return 0;
-		}
-	}
-	return -1;
+	return ret;
 }
 
 
@@ -246,41 +877,185 @@ Remove File:
 	2. Free associated data blocks
 */
 int fs_delete(const char *filename) {
-	
-	if (is_open(filename)) {
-		fs_error("file currently open");
-		return -1;
-	}
 
-	int file_index = locate_file(filename);
-	struct rootdirectory_t* the_dir = &root_dir_block[file_index]; 
-	int frst_dta_blk_i = the_dir->start_data_block;
+	char name[FS_FILENAME_LEN];
+	int dir;
 
-	while (frst_dta_blk_i != EOC) {
-		uint16_t tmp = FAT_blocks[frst_dta_blk_i].words;
-		FAT_blocks[frst_dta_blk_i].words = EMPTY;
-		frst_dta_blk_i = tmp;
+	lock_dirs();
+	int ret = resolve_path(filename, &dir, name);
+	if(ret == 0)
+		ret = delete_entry(dir, name, ENTRY_FILE);
+	unlock_dirs();
+
+	return ret;
+}
+
+
+// Create an empty directory, holding a tree of a single empty leaf
+int fs_mkdir(const char *dirname) {
+
+	char name[FS_FILENAME_LEN];
+	struct rootdirectory_t entry;
+	int dir;
+
+	lock_dirs();
+	int ret = resolve_path(dirname, &dir, name);
+	if(ret == 0 && find_entry(dir, name, &entry, NULL) == 0) {
+		fs_error("file @[%s] already exists\n", name);
+		ret = -1;
 	}
 
-	// reset file to blank slate
-	memset(the_dir->filename, 0, FS_FILENAME_LEN);
-	the_dir->file_size = 0;
+	int node = ret == 0 ? alloc_node(dir) : -1;
+	if(ret == 0 && node < 0)
+		ret = -1;
+
+	if(ret == 0) {
+		struct dir_node_t *leaf = (struct dir_node_t *)get_io_buff();
+		if(leaf) {
+			memset(leaf, 0, BLOCK_SIZE);
+			leaf->type = DIR_LEAF;
+			ret = write_node(node, leaf);
+			put_io_buff((char *)leaf);
+		} else {
+			ret = -1;
+		}
+		if(ret == 0)
+			ret = create_entry(dir, name, ENTRY_DIR, node);
+		if(ret < 0)
+			release_block(node);
+	}
+	unlock_dirs();
 
-	return 0;
+	return ret;
+}
+
+
+// Remove an empty directory and the blocks of its tree
+int fs_rmdir(const char *dirname) {
+
+	char name[FS_FILENAME_LEN];
+	int dir;
+
+	lock_dirs();
+	int ret = resolve_path(dirname, &dir, name);
+	if(ret == 0)
+		ret = delete_entry(dir, name, ENTRY_DIR);
+	unlock_dirs();
+
+	return ret;
 }
 
 
 int fs_ls(void) {
 
+	struct fs_dirent entries[16];
+	int dd = fs_opendir("/");
+	int n;
+
+	if(dd < 0)
+		return -1;
+
 	printf("FS Ls:\n");
-	// finds first available file block in root dir 
-	for(int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if(root_dir_block[i].filename[0] != 0x00) {
-			printf("file: %s, size: %d, ", root_dir_block[i].filename, root_dir_block[i].file_size);
-			printf("data_blk: %d\n", root_dir_block[i].start_data_block);
+	while((n = fs_readdir_bulk(dd, entries, 16)) > 0) {
+		for(int i = 0; i < n; i++) {
+			if(entries[i].is_dir) {
+				printf("dir: %s, data_blk: %u\n", entries[i].name, entries[i].first_block);
+				continue;
+			}
+			printf("file: %s, size: %zu, ", entries[i].name, entries[i].size);
+			printf("data_blk: %u\n", entries[i].first_block);
+		}
+	}
+	fs_closedir(dd);
+
+	return n < 0 ? -1 : 0;
+}
+
+
+// Start listing a directory
+int fs_opendir(const char *dirname) {
+
+	char name[FS_FILENAME_LEN];
+	struct rootdirectory_t entry;
+	int dir = ROOT_DIR;
+
+	if(!superblock || !dirname) {
+		fs_error("no disk mounted or no directory name supplied");
+		return -1;
+	}
+
+	// anything but slashes names a directory below the root one
+	if(dirname[strspn(dirname, "/")] != '\0') {
+		lock_dirs();
+		int ret = resolve_path(dirname, &dir, name);
+		if(ret == 0 && (find_entry(dir, name, &entry, NULL) < 0 || entry.type != ENTRY_DIR)) {
+			fs_error("no directory @[%s]\n", dirname);
+			ret = -1;
+		}
+		unlock_dirs();
+		if(ret < 0)
+			return -1;
+		dir = entry_start(&entry);
+	}
+
+	for(int dd = 0; dd < FS_OPEN_MAX_COUNT; dd++) {
+		if(dir_streams[dd].is_used)
+			continue;
+		memset(&dir_streams[dd], 0, sizeof(struct dir_stream_t));
+		dir_streams[dd].is_used = true;
+		dir_streams[dd].dir = dir;
+		return dd;
+	}
+
+	fs_error("max directory handles already allocated\n");
+	return -1;
+}
+
+
+// Next entry of a directory being listed
+int fs_readdir(int dd, struct fs_dirent *entry) {
+	return fs_readdir_bulk(dd, entry, 1);
+}
+
+
+// Next entries of a directory being listed, as many as fit
+int fs_readdir_bulk(int dd, struct fs_dirent *entries, int count) {
+
+	if(dd < 0 || dd >= FS_OPEN_MAX_COUNT || !dir_streams[dd].is_used ||
+	   !entries || count < 0) {
+		fs_error("invalid directory handle or entry array");
+		return -1;
+	}
+
+	struct dir_stream_t *ds = &dir_streams[dd];
+	int n = 0;
+
+	// the root directory is in memory, its slots are walked in order
+	if(ds->dir == ROOT_DIR) {
+		while(n < count && ds->pos < FS_FILE_MAX_COUNT) {
+			int i = ds->pos++;
+			if(root_dir_block[i].filename[0] != EMPTY)
+				fill_dirent(&entries[n++], &root_dir_block[i]);
 		}
-	}	
+		return n;
+	}
+
+	lock_dirs();
+	n = dir_read(ds, entries, count);
+	unlock_dirs();
+	return n;
+}
+
+
+// Stop listing a directory
+int fs_closedir(int dd) {
+
+	if(dd < 0 || dd >= FS_OPEN_MAX_COUNT || !dir_streams[dd].is_used) {
+		fs_error("invalid directory handle [%d]", dd);
+		return -1;
+	}
 
+	dir_streams[dd].is_used = false;
 	return 0;
 }
 
@@ -295,8 +1070,21 @@ Open and return FD:
 	3. Return file descriptor index, or other wise -1 on failure
 */
 int fs_open(const char *filename) {
+	return fs_open_ex(filename, 0);
+}
+
 
-    int file_index = locate_file(filename);
+int fs_open_ex(const char *filename, int flags) {
+
+	char name[FS_FILENAME_LEN];
+	int dir;
+
+	lock_dirs();
+    int file_index = resolve_path(filename, &dir, name) < 0 ? -1 : get_file_slot(dir, name);
+	// the last descriptor on it was closed and its tail is on the move
+	while (file_index != -1 && packing_index == file_index)
+		uthread_yield();
+	unlock_dirs();
     if(file_index == -1) { 
         fs_error("file @[%s] doesnt exist\n", filename);
         return -1;
@@ -304,15 +1092,30 @@ int fs_open(const char *filename) {
 
     int fd = locate_avail_fd();
     if (fd == -1){
-		fs_error("max file descriptors already allocated\n");
+		fs_error("cannot allocate a file descriptor\n");
+		put_file_slot(file_index);
         return -1;
     }
 
-	fd_table[fd].is_used    = true;
-	fd_table[fd].file_index = file_index;
-	fd_table[fd].offset     = 0;
-	
-	strcpy(fd_table[fd].file_name, filename); 
+	struct file_descriptor_t *fd_obj = fd_table[fd];
+	fd_obj->file       = open_files[file_index];
+	fd_obj->file_index = file_index;
+	fd_obj->offset     = 0;
+	fd_obj->cursor_fat_index = EOC;
+	fd_obj->flags      = flags;
+	fd_obj->wbuf       = NULL;
+	fd_obj->wbuf_len   = 0;
+	fd_obj->ra_next_off = 0;
+	fd_obj->ra_window  = 0;
+	fd_obj->ra_end     = 0;
+	fd_obj->file->refs++;
+
+	if ((flags & FS_OPEN_WBUF) && !(fd_obj->wbuf = get_io_buff())) {
+		fs_error("failure to allocate write buffer\n");
+		release_fd(fd);
+		put_file_slot(file_index);
+		return -1;
+	}
 
     return fd;
 }
@@ -322,27 +1125,49 @@ int fs_open(const char *filename) {
 Close FD object:
 	1. Check that it is a valid FD
 	2. Locate file descriptor object, given its index
-	3. Locate its the associated filename of the fd and decrement its fd
+	3. Hand buffered writes to the file
 	4. Mark FD as available for use
 */
 int fs_close(int fd) {
 
-    if(fd >= FS_OPEN_MAX_COUNT || fd < 0 || fd_table[fd].is_used == 0) {
+    struct file_descriptor_t *fd_obj = get_fd(fd);
+    if(!fd_obj) {
 		fs_error("invalid file descriptor supplied \n");
         return -1;
     }
 
-    struct file_descriptor_t *fd_obj = &fd_table[fd];
+	int file_index = fd_obj->file_index;
+	int ret = flush_wbuf(fd);
 
-    int file_index = locate_file(fd_obj->file_name);
-    if(file_index == -1) { 
-        fs_error("file @[%s] doesnt exist\n", fd_obj->file_name);
-        return -1;
-    } 
+	if (flush_staged(file_index) < 0)
+		ret = -1;
 
-    fd_obj->is_used = false;
+	if (fd_obj->wbuf) {
+		put_io_buff(fd_obj->wbuf);
+		fd_obj->wbuf = NULL;
+	}
+	release_fd(fd);
 
-	return 0;
+	// last descriptor on the file: its partial last block can join others
+	if (tailpack && open_files[file_index]->refs == 0 && pack_tail(file_index) < 0)
+		ret = -1;
+
+	// and its open file object goes away
+	if (put_file_slot(file_index) < 0)
+		ret = -1;
+
+	return ret;
+}
+
+
+// Hand the bytes held in a descriptor's write buffer to the file
+int fs_flush(int fd) {
+    if(!get_fd(fd)) {
+		fs_error("invalid file descriptor supplied \n");
+        return -1;
+    }
+
+	return flush_wbuf(fd);
 }
 
 
@@ -353,20 +1178,18 @@ Return the size of the file corresponding to the specified file descriptor.
 	3. Return file size from appropriate root dir 
 */
 int fs_stat(int fd) {
-    if(fd >= FS_OPEN_MAX_COUNT || fd < 0 || fd_table[fd].is_used == false) {
+    struct file_descriptor_t *fd_obj = get_fd(fd);
+    if(!fd_obj) {
 		fs_error("invalid file descriptor supplied \n");
         return -1;
     }
 
-    struct file_descriptor_t *fd_obj = &fd_table[fd];
-
-    int file_index = locate_file(fd_obj->file_name);
-    if(file_index == -1) { 
-        fs_error("file @[%s] doesnt exist\n", fd_obj->file_name);
-        return -1;
-    } 
+	size_t file_size = file_entry(fd_obj->file_index)->file_size;
 
-	return root_dir_block[file_index].file_size;
+	// count what this descriptor appended but has not flushed yet
+	if (fd_obj->wbuf_len && fd_obj->wbuf_off + fd_obj->wbuf_len > file_size)
+		file_size = fd_obj->wbuf_off + fd_obj->wbuf_len;
+	return file_size;
 }
 
 /*
@@ -377,170 +1200,282 @@ Move supplied fd to supplied offset
 	3. Update offset of fd
 */
 int fs_lseek(int fd, size_t offset) {
-	struct file_descriptor_t *fd_obj = &fd_table[fd];
-    int file_index = locate_file(fd_obj->file_name);
-    if(file_index == -1) { 
-        fs_error("file @[%s] doesnt exist\n", fd_obj->file_name);
+	struct file_descriptor_t *fd_obj = get_fd(fd);
+    if(!fd_obj) {
+		fs_error("invalid file descriptor supplied \n");
         return -1;
-    } 
+    }
+
+	if (flush_wbuf(fd) < 0)
+		return -1;
 
-	int32_t file_size = fs_stat(fd);
+	struct rootdirectory_t *the_dir = file_entry(fd_obj->file_index);
 	
-	if (offset < 0 || offset > file_size) {
-        fs_error("file @[%s] is out of bounds \n", fd_obj->file_name);
-        return -1;
-	} else if (fd_table[fd].is_used == false) {
-        fs_error("invalid file descriptor [%s] \n", fd_obj->file_name);
+	if (offset > the_dir->file_size) {
+        fs_error("file @[%s] is out of bounds \n", the_dir->filename);
         return -1;
 	} 
 
-	fd_table[fd].offset = offset;
+	fd_obj->offset = offset;
 	return 0;
 }
 
-// Write to a file:
+// Write to a file at its descriptor's offset, then move the offset past the data
 int fs_write(int fd, void *buf, size_t count) {
-	// Error Checking 
-	if (count <= 0) {
-        fs_error("request nbytes amount is trivial" );
-        return -1;
-	} else if (fd <= -1 || fd >= FS_OPEN_MAX_COUNT) {
-        fs_error("invalid file descriptor [%d] \n", fd);
-        return -1;
-	} else if (get_num_FAT_free_blocks() == EMPTY) {
-        fs_error("no free entries to write to");
-        return -1;
-	} else if (fd_table[fd].is_used == false) {
-        fs_error("file descriptor is not open");
-        return -1;
+	struct file_descriptor_t *fd_obj = get_fd(fd);
+	if (!fd_obj) {
+		fs_error("invalid file descriptor [%d]", fd);
+		return -1;
 	}
 
-	// find relative information about file 
-	char *file_name = fd_table[fd].file_name;				
-	int file_index = locate_file(file_name);				
-	int offset = fd_table[fd].offset;						
+	// small writes accumulate in the descriptor's buffer
+	if ((fd_obj->flags & FS_OPEN_WBUF) && count > 0 && count < BLOCK_SIZE)
+		return buffer_write(fd, buf, count);
+
+	int ret = fs_pwrite(fd, buf, count, fd_obj->offset);
+	if (ret > 0)
+		fd_obj->offset += ret;
+	return ret;
+}
+
 
-	struct rootdirectory_t *the_dir = &root_dir_block[file_index];	
+// Write to a file at a given offset
+int fs_pwrite(int fd, void *buf, size_t count, size_t offset) {
+	struct iovec iov = { .iov_base = buf, .iov_len = count };
 
-	int num_blocks = ((count + (offset % BLOCK_SIZE)) / BLOCK_SIZE) + 1; 
-	int cur_block = offset/BLOCK_SIZE;					
-	int curr_fat_index = the_dir->start_data_block;
+	if (get_fd(fd) && flush_wbuf(fd) < 0)
+		return -1;
+	return write_iov(fd, &iov, 1, offset);
+}
 
-	// find the extra blocks required for writing count 
-	// amount of bytes from buffer 
- 	int extra_blocks;
- 	if(the_dir->file_size != 0) {
-		int file_width = the_dir->file_size / BLOCK_SIZE;
-		int block_difference = offset + num_blocks * BLOCK_SIZE;
-		extra_blocks = (block_difference / BLOCK_SIZE) - 1;
-		extra_blocks = extra_blocks - file_width;
+
+// Write buffers one after the other to a file at its descriptor's offset
+int fs_writev(int fd, const struct iovec *iov, int iovcnt) {
+	struct file_descriptor_t *fd_obj = get_fd(fd);
+	if (!fd_obj) {
+		fs_error("invalid file descriptor [%d]", fd);
+		return -1;
 	}
-	else extra_blocks = num_blocks;
 
-	// set up information for iterating through blocks
-	char *write_buf = (char*)buf;
-	char bounce_buff[BLOCK_SIZE];
-	
-	int amount_to_write = count;
-	int left_shift;
-	int total_byte_written = 0;
-	int location = offset % BLOCK_SIZE;
+	if (flush_wbuf(fd) < 0)
+		return -1;
 
-	// get to starting block 
-	curr_fat_index = go_to_cur_FAT_block(curr_fat_index, cur_block);
+	int ret = write_iov(fd, iov, iovcnt, fd_obj->offset);
+	if (ret > 0)
+		fd_obj->offset += ret;
+	return ret;
+}
 
-	int available_data_blocks = 0;
-	int fat_block_indices[extra_blocks];
 
-	// locate and store indices of the free blocks
-	// to avoid overwriting other file contents
-	for(int j = 0; j < superblock->num_data_blocks; j++){
-		if(FAT_blocks[j].words == 0){
-			fat_block_indices[available_data_blocks] = j;
-			available_data_blocks++;
-		}
-		if(available_data_blocks == extra_blocks)
-			break;
+// Common part of the write calls: gather count bytes from the buffers of iov
+static int write_iov(int fd, const struct iovec *iov, int iovcnt, size_t offset) {
+	size_t count = iov_length(iov, iovcnt);
+
+	// Error Checking 
+	if (count <= 0) {
+        fs_error("request nbytes amount is trivial" );
+        return -1;
+	} else if (!get_fd(fd)) {
+        fs_error("invalid file descriptor [%d] \n", fd);
+        return -1;
 	}
 
-	// for the case where there are no more availabe data blocks on disk
-	num_blocks = available_data_blocks; 
+	// find relative information about file 
+	int file_index = fd_table[fd]->file_index;				
+	struct rootdirectory_t *the_dir = file_entry(file_index);
 
-	// extending the fat table for a file when it already
-	// contains data 
-	if(the_dir->start_data_block == EOC) { 
-		curr_fat_index = fat_block_indices[0];
-		the_dir->start_data_block = curr_fat_index;
+	// files have no holes: writes start within the file or right after it
+	if (offset > the_dir->file_size) {
+		fs_error("offset %zu beyond end of file @[%s]", offset, the_dir->filename);
+		return -1;
 	}
-	else {
-		int frst_dta_blk_i = the_dir->start_data_block;
-		while(frst_dta_blk_i != EOC){
-			frst_dta_blk_i = FAT_blocks[frst_dta_blk_i].words;
-		}
-		for(int k =0; k < num_blocks; k++){
-			FAT_blocks[frst_dta_blk_i].words = fat_block_indices[k];
-			frst_dta_blk_i = FAT_blocks[frst_dta_blk_i].words;
+
+	// a packed tail goes back to a block of its own before the file changes
+	if (the_dir->tail_block && unpack_tail(file_index) < 0)
+		return -1;
+
+	// tiny files of the root directory live in their entry
+	if (offset + count <= INLINE_MAX_BYTES && can_inline(file_index)) {
+		struct iov_iter src = { .iov = iov, .iovcnt = iovcnt, .skip = 0 };
+		iov_gather(&src, root_inline[file_index] + offset, count);
+		if (offset + count > the_dir->file_size)
+			the_dir->file_size = offset + count;
+		the_dir->flags |= ENTRY_INLINE;
+		root_dir_dirty = true;
+		return count;
+	}
+	// and get a data block once they outgrow it
+	if ((the_dir->flags & ENTRY_INLINE) && spill_inline(file_index) < 0)
+		return -1;
+
+	if (delalloc) {
+		// bound the memory held by staged blocks
+		if (num_staged_blocks >= DELALLOC_MAX_BLOCKS && flush_all_staged() < 0)
+			return -1;
+		// with the whole FAT in memory, nothing parks from here until the
+		// staged bytes are copied, so no flush can move them meanwhile
+		if (load_free_map() < 0) {
+			fs_error("failure to load FAT");
+			return -1;
 		}
-		FAT_blocks[frst_dta_blk_i].words = EOC;
+		// the chain is growing under a flush of this file
+		while (staged[file_index] && staged[file_index]->flushing)
+			uthread_yield();
 	}
 
-	num_blocks = ((count + (offset % BLOCK_SIZE)) / BLOCK_SIZE) + 1;
+	// extend the chain with as many blocks as the write needs, or as
+	// many as are left on disk (staged in memory with delayed allocation)
+	int chain_len;
+	int tail = get_chain_tail(fd, &chain_len);
+	int needed = (offset + count + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	size_t covered = chain_len;
+
+	// growing the file needs the free block bitmap
+	if (chain_len < needed && load_free_map() < 0) {
+		fs_error("failure to load FAT");
+		return -1;
+	}
 
-	// write to the disk as much as we can (dont overload the disk)
-	int num_free = get_num_FAT_free_blocks();
-	if (num_blocks > num_free) {
-		num_blocks = num_free;
+	if (chain_len < needed) {
+		if (delalloc)
+			covered = stage_blocks(file_index, chain_len, needed);
+		else
+			covered = chain_len = extend_chain(file_index, tail, chain_len, needed);
 	}
 
-	// main iteration loop for writing block per block
-	for (int i = 0; i < num_blocks; i++) {
-		if (location + amount_to_write > BLOCK_SIZE) {
-			left_shift = BLOCK_SIZE - location;
-		} else {
+	// for the case where there are no more availabe data blocks on disk
+	if (offset + count > covered * BLOCK_SIZE)
+		count = covered * BLOCK_SIZE - offset;
+	if (count == 0)
+		return 0;
+
+	// bytes past the chain go to the staged blocks
+	size_t chain_bytes = (size_t)chain_len * BLOCK_SIZE;
+	size_t staged_count = 0;
+	if (offset + count > chain_bytes) {
+		staged_count = offset < chain_bytes ? offset + count - chain_bytes : count;
+		count -= staged_count;
+	}
+
+	// set up information for iterating through blocks
+	struct iov_iter src = { .iov = iov, .iovcnt = iovcnt, .skip = 0 };
+	size_t old_size = the_dir->file_size;
+
+	// the staged bytes go in before the chain I/O can park this thread
+	if (staged_count) {
+		struct staged_t *st = staged[file_index];
+		struct iov_iter staged_src = src;
+		iov_advance(&staged_src, count);
+		iov_gather(&staged_src, st->data + (offset + count - st->first_block * BLOCK_SIZE),
+		           staged_count);
+	}
+	size_t amount_to_write = count;
+	size_t left_shift;
+	size_t total_byte_written = 0;
+	size_t location = offset % BLOCK_SIZE;
+	size_t cur_block = offset / BLOCK_SIZE;
+	int blocks_left = count ? (location + count + BLOCK_SIZE - 1) / BLOCK_SIZE : 0;
+
+	// get to starting block 
+	int curr_fat_index = blocks_left ? seek_fd_block(fd, cur_block) : EOC;
+
+	char *io_buff = get_io_buff();
+	if (!io_buff) {
+		fs_error("failure to allocate staging buffer");
+		return -1;
+	}
+
+	// main iteration loop, one physically contiguous run of blocks at a time
+	while (blocks_left > 0) {
+		int next_fat_index;
+		int run = contiguous_run(curr_fat_index, blocks_left, &next_fat_index);
+
+		left_shift = run * BLOCK_SIZE - location;
+		if (left_shift > amount_to_write)
 			left_shift = amount_to_write;
+
+		// a block that could not be merged must not be written back
+		if (write_run(curr_fat_index, cur_block, location, &src, left_shift,
+		              old_size, io_buff) < 0) {
+			fs_error("failure to write to block \n");
+			put_io_buff(io_buff);
+			return -1;
 		}
 
-		memcpy(bounce_buff + location, write_buf, left_shift);
-		block_write(curr_fat_index + superblock->data_start_index, (void*)bounce_buff);
-		
 		// position array to left block 
 		total_byte_written += left_shift;
-		write_buf += left_shift;
-
-		location= 0;
 		amount_to_write -= left_shift;
 
-		// updating the final FAT entry values 
-		if(i < num_blocks - 1){
-			FAT_blocks[curr_fat_index].words = fat_block_indices[i+1];
-			curr_fat_index = FAT_blocks[curr_fat_index].words;
-		}
-		else{
-			FAT_blocks[curr_fat_index].words = EOC;
-			curr_fat_index = FAT_blocks[curr_fat_index].words;
-		}
+		set_fd_cursor(fd, cur_block + run - 1, curr_fat_index + run - 1);
+
+		location = 0;
+		cur_block += run;
+		blocks_left -= run;
+		curr_fat_index = next_fat_index;
 	}
+	put_io_buff(io_buff);
+
+	if (amount_to_write == 0)
+		total_byte_written += staged_count;
 
 	// update filesize accordingly to how much was written 
 	if(offset + total_byte_written > the_dir->file_size){
 		the_dir->file_size = offset + total_byte_written;
+		entry_dirty(file_index);
 	}
 
-	fd_table[fd].offset += total_byte_written;
 	return total_byte_written;
 }
 
 
+// Read from a file at its descriptor's offset, then move the offset past the data
+int fs_read(int fd, void *buf, size_t count) {
+	struct file_descriptor_t *fd_obj = get_fd(fd);
+	if (!fd_obj) {
+		fs_error("invalid file descriptor [%d]", fd);
+		return -1;
+	}
+
+	int ret = fs_pread(fd, buf, count, fd_obj->offset);
+	if (ret > 0)
+		fd_obj->offset += ret;
+	return ret;
+}
+
+
+// Read from a file at a given offset
+int fs_pread(int fd, void *buf, size_t count, size_t offset) {
+	struct iovec iov = { .iov_base = buf, .iov_len = count };
+
+	return read_iov(fd, &iov, 1, offset);
+}
+
+
+// Read from a file at its descriptor's offset into buffers one after the other
+int fs_readv(int fd, const struct iovec *iov, int iovcnt) {
+	struct file_descriptor_t *fd_obj = get_fd(fd);
+	if (!fd_obj) {
+		fs_error("invalid file descriptor [%d]", fd);
+		return -1;
+	}
+
+	int ret = read_iov(fd, iov, iovcnt, fd_obj->offset);
+	if (ret > 0)
+		fd_obj->offset += ret;
+	return ret;
+}
+
+
 /*
-Read a File:
+Read a File at a given offset, scattering the data over the buffers of iov:
 	1. Error check that the amount to be read is > 0, and that the
 	   the file descriptor is valid.
 */
-int fs_read(int fd, void *buf, size_t count) {
+static int read_iov(int fd, const struct iovec *iov, int iovcnt, size_t offset) {
+	size_t count = iov_length(iov, iovcnt);
 	
 	// error check 
-    if(fd_table[fd].is_used == false || 
-	   fd >= FS_OPEN_MAX_COUNT) {
+    if(!get_fd(fd)) {
 		fs_error("invalid file descriptor [%d]", fd);
         return -1;
     } else if (count <= 0) {
@@ -548,88 +1483,305 @@ int fs_read(int fd, void *buf, size_t count) {
 		return -1;
 	} 
 
+	// buffered writes of this descriptor come first
+	if (flush_wbuf(fd) < 0)
+		return -1;
+
 	// gather nessessary information 
-	char *file_name = fd_table[fd].file_name;
-	int file_index = locate_file(file_name);
-	size_t offset = fd_table[fd].offset;
+	int file_index = fd_table[fd]->file_index;
 	
-	struct rootdirectory_t *the_dir = &root_dir_block[file_index];
+	struct rootdirectory_t *the_dir = file_entry(file_index);
 
 
 	// check if offset of file exceeds the file_size
-	int amount_to_read = 0;
-	if (offset + count > the_dir->file_size) 
-		amount_to_read = abs(the_dir->file_size - offset);
+	size_t amount_to_read = 0;
+	if (offset >= the_dir->file_size)
+		return 0;
+	else if (offset + count > the_dir->file_size) 
+		amount_to_read = the_dir->file_size - offset;
 	else amount_to_read = count;
 
-	char *read_buf = (char *)buf;
-	int16_t FAT_iter = the_dir->start_data_block;
-	size_t num_blocks = (amount_to_read / BLOCK_SIZE) + 1;
-	
+	// the whole file is in its root directory entry
+	if (the_dir->flags & ENTRY_INLINE) {
+		struct iov_iter dst = { .iov = iov, .iovcnt = iovcnt, .skip = 0 };
+		iov_scatter(&dst, root_inline[file_index] + offset, amount_to_read);
+		return amount_to_read;
+	}
+
+	update_readahead(fd, offset, amount_to_read);
+
+	// a flush in progress moves the staged blocks onto the chain, wait it out
+	while (staged[file_index] && staged[file_index]->flushing)
+		uthread_yield();
+
+	// bytes past the chain are still in the staged blocks
+	struct staged_t *st = staged[file_index];
+	size_t staged_count = 0;
+	if (st && offset + amount_to_read > st->first_block * BLOCK_SIZE) {
+		size_t chain_bytes = st->first_block * BLOCK_SIZE;
+		staged_count = offset < chain_bytes ? offset + amount_to_read - chain_bytes
+		                                    : amount_to_read;
+		amount_to_read -= staged_count;
+	}
+
+	// so is the partial last block of a packed file, in its fragment block
+	size_t tail_count = 0;
+	size_t whole_bytes = the_dir->file_size / BLOCK_SIZE * BLOCK_SIZE;
+	if (the_dir->tail_block && offset + amount_to_read > whole_bytes) {
+		tail_count = offset < whole_bytes ? offset + amount_to_read - whole_bytes
+		                                  : amount_to_read;
+		amount_to_read -= tail_count;
+	}
+	size_t tail_offset = offset + amount_to_read;
+	size_t staged_offset = tail_offset + tail_count;
+
+	struct iov_iter dst = { .iov = iov, .iovcnt = iovcnt, .skip = 0 };
+
+	// copy the staged bytes before any I/O parks this thread: a flush or a
+	// write on another descriptor may free or move them in the meantime
+	if (staged_count) {
+		struct iov_iter staged_dst = dst;
+		iov_advance(&staged_dst, staged_offset - offset);
+		iov_scatter(&staged_dst, st->data + (staged_offset - st->first_block * BLOCK_SIZE),
+		            staged_count);
+	}
+
+	char *io_buff = get_io_buff();
+	if (!io_buff) {
+		fs_error("failure to allocate staging buffer");
+		return -1;
+	}
+
+	// the fragment may be unpacked while the chain is read, so it goes first
+	size_t total_bytes_read = 0;
+	if (tail_count) {
+		struct iov_iter tail_dst = dst;
+		size_t tail_at = the_dir->tail_offset + (tail_offset - whole_bytes);
+		iov_advance(&tail_dst, tail_offset - offset);
+		if (cache_read(the_dir->tail_block + vol.data_start_index, io_buff) < 0) {
+			fs_error("failure to read from block \n");
+			put_io_buff(io_buff);
+			return -1;
+		}
+		iov_scatter(&tail_dst, io_buff + tail_at, tail_count);
+	}
+
 	// block level
-	int cur_block = offset / BLOCK_SIZE; 
+	size_t cur_block = offset / BLOCK_SIZE; 
 
 	// byte level
-	int location= offset % BLOCK_SIZE;
-	char bounce_buff[BLOCK_SIZE];
+	size_t location = offset % BLOCK_SIZE;
+	int blocks_left = amount_to_read ? (location + amount_to_read + BLOCK_SIZE - 1) / BLOCK_SIZE : 0;
 		
 	// go to correct current block in fat entry
-	FAT_iter = go_to_cur_FAT_block(FAT_iter, cur_block);
-
-	// read through the number of blocks it contains
-	int left_shift = 0;
-	int total_bytes_read = 0;
-	for (int i = 0; i < num_blocks; i++) {
-		if (location+ amount_to_read > BLOCK_SIZE) {
-			left_shift = BLOCK_SIZE - location;
-		} else {
+	int FAT_iter = blocks_left ? seek_fd_block(fd, cur_block) : EOC;
+
+	// read through the blocks, one physically contiguous run at a time
+	size_t left_shift = 0;
+	while (blocks_left > 0) {
+		int next_FAT_iter;
+		int run = contiguous_run(FAT_iter, blocks_left, &next_FAT_iter);
+
+		left_shift = run * BLOCK_SIZE - location;
+		if (left_shift > amount_to_read)
 			left_shift = amount_to_read;
-		}
 
 		// read file contents 
-		block_read(FAT_iter + superblock->data_start_index, (void*)bounce_buff);
-		memcpy(read_buf, bounce_buff + location, left_shift);
+		if (read_run(FAT_iter, location, &dst, left_shift, io_buff) < 0) {
+			fs_error("failure to read from block \n");
+			break;
+		}
+		set_fd_cursor(fd, cur_block + run - 1, FAT_iter + run - 1);
 
 		// position array to left block 
 		total_bytes_read += left_shift;
-		read_buf += left_shift;
 
 		// next block starts at the top
-		location= 0;
+		location = 0;
 
 		// next 
-		FAT_iter = FAT_blocks[FAT_iter].words;
+		FAT_iter = next_FAT_iter;
+		cur_block += run;
+		blocks_left -= run;
 
 		// reduce the amount to read by the amount that was read 
 		amount_to_read -= left_shift;
 	}
 
-	fd_table[fd].offset += total_bytes_read;
+	put_io_buff(io_buff);
+
+	// the tail and staged bytes are already in place past the chain bytes
+	if (amount_to_read == 0)
+		total_bytes_read += tail_count + staged_count;
+
+	// a stream in progress gets the blocks after this read brought in
+	if (amount_to_read == 0 && FAT_iter != EOC && fd_table[fd]->ra_window)
+		readahead(fd, cur_block, FAT_iter);
+
 	return total_bytes_read;
 }
 
 
+// Report how scattered free space and files are
+int fs_frag_stats(struct fs_frag_stats *stats) {
+
+	if(!superblock || !stats) {
+		fs_error("no disk mounted or no stats structure supplied");
+		return -1;
+	}
+
+	if(load_free_map() < 0) {
+		fs_error("failure to load FAT");
+		return -1;
+	}
+
+	if(!extents_valid && rebuild_extents() < 0) {
+		fs_error("failure to index free extents");
+		return -1;
+	}
+
+	memset(stats, 0, sizeof(*stats));
+	stats->free_blocks = num_free_blocks;
+	for(int e = 0; e < num_extents; e++) {
+		if(extents[e].len == 0)
+			continue;
+		stats->free_extents++;
+		if((size_t)extents[e].len > stats->largest_free_extent)
+			stats->largest_free_extent = extents[e].len;
+	}
+
+	// subdirectories are walked with the entries of open files up to date
+	int ret = 0;
+	lock_dirs();
+	if(write_sub_entries() < 0)
+		ret = -1;
+	for(int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if(root_dir_block[i].filename[0] == EMPTY)
+			continue;
+		if(root_dir_block[i].type == ENTRY_DIR) {
+			if(dir_frag_stats(get_start_block(i), stats) < 0)
+				ret = -1;
+		} else {
+			chain_frag_stats(get_start_block(i), stats);
+		}
+	}
+	unlock_dirs();
+
+	return ret;
+}
+
+
+// Set the block cache size used by the next mount
+int fs_cache_config(size_t nblocks) {
+
+	if(superblock) {
+		fs_error("cannot resize cache while mounted");
+		return -1;
+	}
+
+	cache_blocks = nblocks;
+	return 0;
+}
+
+
+int fs_cache_stats(struct fs_cache_stats *stats) {
+
+	struct cache_stats cstats;
+
+	if(!stats) {
+		fs_error("no stats structure supplied");
+		return -1;
+	}
+
+	cache_get_stats(&cstats);
+	stats->hits       = cstats.hits;
+	stats->misses     = cstats.misses;
+	stats->evictions  = cstats.evictions;
+	stats->writebacks = cstats.writebacks;
+	stats->readahead_blocks = cstats.prefetched;
+	stats->readahead_hits   = cstats.prefetch_hits;
+	stats->readahead_unused = cstats.prefetch_unused;
+
+	return 0;
+}
+
+
 /*
 Locate Existing File
 	1. Return the position of first filename that matches the search,
 	   and is in use (contains data).
 */
 static int locate_file(const char* file_name) {
-	int i;
-    for(i = 0; i < FS_FILE_MAX_COUNT; i++) 
-        if(strncmp(root_dir_block[i].filename, file_name, FS_FILENAME_LEN) == 0 &&  
-			      root_dir_block[i].filename != EMPTY) 
-            return i;  
-    return -1;      
+	unsigned slot = hash_name(file_name);
+
+	while (name_hash[slot] != 0) {
+		int i = name_hash[slot] - 1;
+		if (strncmp(root_dir_block[i].filename, file_name, FS_FILENAME_LEN) == 0)
+			return i;
+		slot = (slot + 1) % NAME_HASH_SIZE;
+	}
+	return -1;
 }
 
 
+// helper: open, take a descriptor off the free list, growing the table when
+// it is empty
 static int locate_avail_fd() {
-	int i;
-	for(i = 0; i < FS_OPEN_MAX_COUNT; i++) 
-        if(fd_table[i].is_used == false) 
-			return i; 
-    return -1;
+	if (fd_free == -1 && grow_fd_table() < 0)
+		return -1;
+
+	int fd = fd_free;
+	fd_free = fd_table[fd]->next_free;
+	return fd;
+}
+
+
+// helper: open, double the descriptor table (FS_OPEN_MAX_COUNT descriptors at
+// first), the new descriptors going on the free list lowest first
+static int grow_fd_table(void)
+{
+	int grow = fd_table_size ? fd_table_size : FS_OPEN_MAX_COUNT;
+	struct file_descriptor_t **table;
+	struct file_descriptor_t *chunk;
+
+	if (fd_table_size > INT_MAX / 2)
+		return -1;
+	table = realloc(fd_table, (fd_table_size + grow) * sizeof(*table));
+	if (!table)
+		return -1;
+	fd_table = table;
+	if (!(chunk = calloc(grow, sizeof(*chunk))))
+		return -1;
+
+	for (int i = grow - 1; i >= 0; i--) {
+		fd_table[fd_table_size + i] = &chunk[i];
+		chunk[i].next_free = fd_free;
+		fd_free = fd_table_size + i;
+	}
+	fd_table_size += grow;
+	return 0;
+}
+
+
+// helper: close, put a descriptor back on the free list and drop its
+// reference to the open file
+static void release_fd(int fd)
+{
+	struct file_descriptor_t *fd_obj = fd_table[fd];
+
+	fd_obj->file->refs--;
+	fd_obj->file = NULL;
+	fd_obj->next_free = fd_free;
+	fd_free = fd;
+}
+
+
+// helper: the descriptor fd if it is open, NULL otherwise
+static struct file_descriptor_t *get_fd(int fd)
+{
+	if (fd < 0 || fd >= fd_table_size || !fd_table[fd]->file)
+		return NULL;
+	return fd_table[fd];
 }
 
 
@@ -641,33 +1793,21 @@ Perform Error Checking
 */
 static bool error_free(const char *filename){
 
-	// get size 
+	// get size (the NULL character has to fit as well)
 	int size = strlen(filename);
-	if(size > FS_FILENAME_LEN){
-		fs_error("File name is longer than FS_FILE_MAX_COUNT\n");
+	if(size == 0 || size >= FS_FILENAME_LEN){
+		fs_error("File name is longer than FS_FILENAME_LEN\n");
 		return false;
 	}
 
-	// check if file already exists 
-	int same_char = 0;
-	int files_in_rootdir = 0;
-	for(int i = 0; i < FS_FILE_MAX_COUNT; i++){
-		for(int j = 0; j < size; j ++){
-			if(root_dir_block[i].filename[j] == filename[j])
-				same_char++;
-		}
-		if(root_dir_block[i].filename[0] != EMPTY)
-			files_in_rootdir++;
-	}
 	// File already exists
-	if(same_char == size){
+	if(locate_file(filename) != -1){
 		fs_error("file @[%s] already exists\n", filename);
 		return false;
 	}
-		
 
 	// if there are 128 files in rootdirectory 
-	if(files_in_rootdir == FS_FILE_MAX_COUNT){
+	if(num_files == FS_FILE_MAX_COUNT){
 		fs_error("All files in rootdirectory are taken\n");
 		return false;
 	}
@@ -691,13 +1831,9 @@ static bool is_open(const char* filename)
         return true;
 	}
 
-	struct rootdirectory_t* the_dir = &root_dir_block[file_index]; 
-	for(int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-		if(strncmp(the_dir->filename, fd_table[i].file_name, FS_FILENAME_LEN) == 0 
-		   && fd_table[i].is_used) {
-			fs_error("cannot remove file @[%s] as it is currently open\n", filename);
-			return true;
-		}
+	if(open_files[file_index] && open_files[file_index]->refs > 0) {
+		fs_error("cannot remove file @[%s] as it is currently open\n", filename);
+		return true;
 	}
 
 	return false;
@@ -706,36 +1842,2140 @@ static bool is_open(const char* filename)
 // helper: info
 static int get_num_FAT_free_blocks()
 {
-	int count = 0;
-	for (int i = 1; i < superblock->num_data_blocks; i++) {
-		if (FAT_blocks[i].words == EMPTY) count++;
+	if (load_free_map() < 0)
+		return -1;
+	return num_free_blocks;
+}
+
+
+// helper: free space, read whatever part of the FAT is still on disk and build
+// the free block bitmap, once per mount
+static int load_free_map(void)
+{
+	if (free_map)
+		return 0;
+	if (load_FAT_blocks(0, vol.num_FAT_blocks) < 0)
+		return -1;
+	return build_free_map();
+}
+
+
+// helper: set a bit for every free FAT entry (entry 0 is reserved), once the
+// whole FAT has been checked for chains leading off the disk
+static int build_free_map(void)
+{
+	size_t bad = fatscan_find_invalid(FAT_blocks, vol.FAT_entry_size,
+	                                  vol.num_data_blocks, vol.num_data_blocks);
+	if (bad < (size_t)vol.num_data_blocks) {
+		fs_error("FAT entry %zu points outside of the disk \n", bad);
+		return -1;
 	}
-	return count;
+
+	free_map_words = (vol.num_data_blocks + 63) / 64;
+	free_map = malloc(free_map_words * sizeof(uint64_t));
+	if (!free_map)
+		return -1;
+
+	extents_valid = false;
+	alloc_cursor = 0;
+	num_free_blocks = fatscan_free_map(FAT_blocks, vol.FAT_entry_size,
+	                                   vol.num_data_blocks, free_map);
+	if (free_map[0] & 1) {
+		free_map[0] &= ~(uint64_t)1;
+		num_free_blocks--;
+	}
+	return 0;
 }
 
 
-// helper: info
-static int count_num_open_dir(){
+// helper: allocator, first free (or used) block at or after pos
+static int find_next_bit(int pos, bool want_free)
+{
+	int total = free_map_words * 64;
+
+	while (pos < total) {
+		uint64_t word = free_map[pos / 64];
+		if (!want_free)
+			word = ~word;
+		word &= ~(uint64_t)0 << (pos % 64);
+		if (word)
+			return (pos & ~63) + __builtin_ctzll(word);
+		pos = (pos & ~63) + 64;
+	}
+	return total;
+}
 
-	int i, count = 0;
-	for(i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if(root_dir_block[i].filename[0] == EMPTY)
-			count++;
+
+static int ext_bucket_of(int len)
+{
+	return 31 - __builtin_clz(len);
+}
+
+
+static void ext_bucket_unlink(int e)
+{
+	struct free_extent *ext = &extents[e];
+
+	if (ext->prev != EXT_NIL)
+		extents[ext->prev].next = ext->next;
+	else
+		ext_buckets[ext_bucket_of(ext->len)] = ext->next;
+	if (ext->next != EXT_NIL)
+		extents[ext->next].prev = ext->prev;
+}
+
+
+static void ext_bucket_link(int e)
+{
+	struct free_extent *ext = &extents[e];
+	int b = ext_bucket_of(ext->len);
+
+	ext->prev = EXT_NIL;
+	ext->next = ext_buckets[b];
+	if (ext->next != EXT_NIL)
+		extents[ext->next].prev = e;
+	ext_buckets[b] = e;
+}
+
+
+// helper: allocator, index the free runs of the bitmap
+static int rebuild_extents(void)
+{
+	int total = vol.num_data_blocks;
+	int count = 0;
+
+	for (int pos = find_next_bit(0, true); pos < total; ) {
+		int end = find_next_bit(pos, false);
+		count++;
+		pos = find_next_bit(end, true);
+	}
+
+	free(extents);
+	extents = malloc((count ? count : 1) * sizeof(struct free_extent));
+	if (!extents)
+		return -1;
+
+	for (int b = 0; b < EXT_BUCKETS; b++)
+		ext_buckets[b] = EXT_NIL;
+
+	num_extents = 0;
+	for (int pos = find_next_bit(0, true); pos < total; ) {
+		int end = find_next_bit(pos, false);
+		extents[num_extents].start = pos;
+		extents[num_extents].len = end - pos;
+		ext_bucket_link(num_extents);
+		num_extents++;
+		pos = find_next_bit(end, true);
+	}
+
+	extents_valid = true;
+	return 0;
+}
+
+
+// helper: allocator, extent (in start order) that holds a free block
+static int find_extent(int block)
+{
+	int lo = 0, hi = num_extents - 1;
+
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+		if (extents[mid].start > block)
+			hi = mid - 1;
+		else if (extents[mid].start + extents[mid].len <= block)
+			lo = mid + 1;
+		else
+			return extents[mid].len ? mid : EXT_NIL;
 	}
-	return count;
+	return EXT_NIL;
 }
 
 
-// helper: read and write 
-static int go_to_cur_FAT_block(int cur_fat_index, int iter_amount)
+// helper: allocator, extent able to hold want blocks: the smallest bucket
+// that has one, and in it the next one at or after the cursor
+static int find_fitting_extent(int want)
 {
-	for (int i = 0; i < iter_amount; i++) {
-		if (cur_fat_index == EOC) {
-			fs_error("attempted to exceed end of file chain");
-			return -1;
+	for (int b = ext_bucket_of(want); b < EXT_BUCKETS; b++) {
+		int best = EXT_NIL, wrap = EXT_NIL;
+		for (int e = ext_buckets[b]; e != EXT_NIL; e = extents[e].next) {
+			if (extents[e].len < want)
+				continue;
+			if (extents[e].start >= alloc_cursor) {
+				if (best == EXT_NIL || extents[e].start < extents[best].start)
+					best = e;
+			} else if (wrap == EXT_NIL || extents[e].start < extents[wrap].start) {
+				wrap = e;
+			}
 		}
-		cur_fat_index = FAT_blocks[cur_fat_index].words;
+		if (best != EXT_NIL)
+			return best;
+		if (wrap != EXT_NIL)
+			return wrap;
 	}
-	return cur_fat_index;
+	return EXT_NIL;
+}
+
+
+// helper: allocator, longest free extent
+static int find_largest_extent(void)
+{
+	for (int b = EXT_BUCKETS - 1; b >= 0; b--) {
+		int best = EXT_NIL;
+		for (int e = ext_buckets[b]; e != EXT_NIL; e = extents[e].next)
+			if (best == EXT_NIL || extents[e].len > extents[best].len)
+				best = e;
+		if (best != EXT_NIL)
+			return best;
+	}
+	return EXT_NIL;
+}
+
+
+/*
+Allocate a run of contiguous blocks (caller links them in the FAT):
+	1. Continue right at goal (block after the file's tail) if it is free.
+	2. Otherwise use the best-fitting extent that can hold all want blocks.
+	3. Otherwise take the largest extent; the caller asks again for the rest.
+Returns the first block and sets got to the run length, or -1 if the disk
+is full.
+*/
+static int alloc_extent(int goal, int want, int *got)
+{
+	if (num_free_blocks == 0)
+		return -1;
+	if (!extents_valid && rebuild_extents() < 0)
+		return -1;
+
+	int e = EXT_NIL;
+	if (goal > 0 && goal < vol.num_data_blocks)
+		e = find_extent(goal);
+	if (e == EXT_NIL || extents[e].start != goal)
+		e = find_fitting_extent(want);
+	if (e == EXT_NIL)
+		e = find_largest_extent();
+	if (e == EXT_NIL)
+		return -1;
+
+	struct free_extent *ext = &extents[e];
+	int start = ext->start;
+	int take = want < ext->len ? want : ext->len;
+
+	ext_bucket_unlink(e);
+	ext->start += take;
+	ext->len   -= take;
+	if (ext->len)
+		ext_bucket_link(e);
+
+	for (int i = start; i < start + take; i++)
+		free_map[i / 64] &= ~((uint64_t)1 << (i % 64));
+	num_free_blocks -= take;
+	alloc_cursor = start + take;
+
+	*got = take;
+	return start;
 }
 
+
+// helper: delete, give a block back to the free pool
+static void release_block(int fat_index)
+{
+	set_FAT(fat_index, EMPTY);
+	// without a bitmap yet, the freed entry is picked up when it is built
+	if (!free_map)
+		return;
+	free_map[fat_index / 64] |= (uint64_t)1 << (fat_index % 64);
+	num_free_blocks++;
+	extents_valid = false;
+}
+
+
+// helper: read the not yet loaded FAT blocks among [first, first + count),
+// one disk request per run of consecutive missing blocks
+static int load_FAT_blocks(int first, int count)
+{
+	int i = first;
+
+	while (i < first + count) {
+		if (FAT_loaded[i]) {
+			i++;
+			continue;
+		}
+		int j = i;
+		while (j < first + count && !FAT_loaded[j])
+			j++;
+		if (block_read_range(i + 1, j - i, FAT_blocks + (size_t)i * BLOCK_SIZE) < 0) {
+			fs_error("failure to read from block \n");
+			return -1;
+		}
+		while (i < j)
+			FAT_loaded[i++] = true;
+	}
+	return 0;
+}
+
+
+// helper: value of a FAT entry, faulting its block in; a block that cannot
+// be read ends the chain
+static int get_FAT(int fat_index)
+{
+	int block = (size_t)fat_index * vol.FAT_entry_size / BLOCK_SIZE;
+
+	if (!FAT_loaded[block] && load_FAT_blocks(block, 1) < 0)
+		return EOC;
+	if (vol.FAT_entry_size == 2) {
+		uint16_t value = ((uint16_t *)FAT_blocks)[fat_index];
+		return value == UINT16_MAX ? EOC : value;
+	}
+	uint32_t value = ((uint32_t *)FAT_blocks)[fat_index];
+	return value == UINT32_MAX ? EOC : (int)value;
+}
+
+
+// helper: update a FAT entry and remember its block needs writing out
+static void set_FAT(int fat_index, int value)
+{
+	// the rest of the block must be valid before it can be written back
+	get_FAT(fat_index);
+	if (vol.FAT_entry_size == 2)
+		((uint16_t *)FAT_blocks)[fat_index] = value == EOC ? UINT16_MAX : value;
+	else
+		((uint32_t *)FAT_blocks)[fat_index] = value == EOC ? UINT32_MAX : (uint32_t)value;
+	FAT_dirty[(size_t)fat_index * vol.FAT_entry_size / BLOCK_SIZE] = true;
+}
+
+
+// helper: first data block of a file
+static int get_start_block(int file_index)
+{
+	return entry_start(file_entry(file_index));
+}
+
+
+static void set_start_block(int file_index, int block)
+{
+	set_entry_start(file_entry(file_index), block);
+	entry_dirty(file_index);
+}
+
+
+static int entry_start(const struct rootdirectory_t *the_dir)
+{
+	uint32_t start = the_dir->start_data_block;
+
+	if (vol.FAT_entry_size == 4)
+		start |= (uint32_t)the_dir->start_data_block_hi << 16;
+	return start == disk_EOC() ? EOC : (int)start;
+}
+
+
+static void set_entry_start(struct rootdirectory_t *the_dir, int block)
+{
+	uint32_t start = block == EOC ? disk_EOC() : (uint32_t)block;
+
+	the_dir->start_data_block = start & 0xFFFF;
+	if (vol.FAT_entry_size == 4)
+		the_dir->start_data_block_hi = start >> 16;
+}
+
+
+// helper: end of chain marker as stored on disk
+static uint32_t disk_EOC(void)
+{
+	return vol.FAT_entry_size == 2 ? UINT16_MAX : UINT32_MAX;
+}
+
+
+// helper: mount, layout of the volume described by the superblock
+static int read_volume(void)
+{
+	switch (superblock->version) {
+	case FORMAT_FAT16:
+		vol.num_blocks       = superblock->num_blocks;
+		vol.root_dir_index   = superblock->root_dir_index;
+		vol.data_start_index = superblock->data_start_index;
+		vol.num_data_blocks  = superblock->num_data_blocks;
+		vol.num_FAT_blocks   = superblock->num_FAT_blocks;
+		vol.FAT_entry_size   = 2;
+		break;
+	case FORMAT_FAT32:
+		if (superblock->num_blocks_32 > INT32_MAX ||
+		    superblock->num_data_blocks_32 >= INT32_MAX) {
+			fs_error("volume too large \n");
+			return -1;
+		}
+		vol.num_blocks       = superblock->num_blocks_32;
+		vol.root_dir_index   = superblock->root_dir_index_32;
+		vol.data_start_index = superblock->data_start_index_32;
+		vol.num_data_blocks  = superblock->num_data_blocks_32;
+		vol.num_FAT_blocks   = superblock->num_FAT_blocks_32;
+		vol.FAT_entry_size   = 4;
+		break;
+	default:
+		fs_error("unsupported format version %d \n", superblock->version);
+		return -1;
+	}
+
+	if (superblock->features & ~(FEATURE_INLINE | FEATURE_TAILPACK)) {
+		fs_error("unsupported features %#x \n", superblock->features);
+		return -1;
+	}
+	vol.inline_data = (superblock->features & FEATURE_INLINE) != 0;
+
+	// the FAT must cover every data block, all of them on the disk
+	if ((size_t)vol.num_FAT_blocks * BLOCK_SIZE / vol.FAT_entry_size < (size_t)vol.num_data_blocks ||
+	    (size_t)vol.data_start_index + vol.num_data_blocks > (size_t)vol.num_blocks) {
+		fs_error("inconsistent superblock \n");
+		return -1;
+	}
+	return 0;
+}
+
+
+// helper: info
+static int count_num_open_dir(){
+	return FS_FILE_MAX_COUNT - num_files;
+}
+
+
+// helper: name index, FNV-1a over the (at most FS_FILENAME_LEN) name bytes
+static unsigned hash_name(const char *file_name)
+{
+	uint32_t h = 2166136261u;
+
+	for (int i = 0; i < FS_FILENAME_LEN && file_name[i]; i++) {
+		h ^= (unsigned char)file_name[i];
+		h *= 16777619u;
+	}
+	return h % NAME_HASH_SIZE;
+}
+
+
+// helper: mount, index every used root directory entry
+static void build_name_hash(void)
+{
+	memset(name_hash, 0, sizeof(name_hash));
+	num_files = 0;
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+		if (root_dir_block[i].filename[0] != EMPTY)
+			name_hash_insert(i);
+}
+
+
+static void name_hash_insert(int file_index)
+{
+	unsigned slot = hash_name(root_dir_block[file_index].filename);
+
+	while (name_hash[slot] != 0)
+		slot = (slot + 1) % NAME_HASH_SIZE;
+	name_hash[slot] = file_index + 1;
+	num_files++;
+}
+
+
+// helper: delete, remove an entry and shift back the ones probing past it
+static void name_hash_remove(int file_index)
+{
+	unsigned slot = hash_name(root_dir_block[file_index].filename);
+
+	while (name_hash[slot] != file_index + 1)
+		slot = (slot + 1) % NAME_HASH_SIZE;
+	name_hash[slot] = 0;
+	num_files--;
+
+	for (unsigned next = (slot + 1) % NAME_HASH_SIZE; name_hash[next] != 0;
+	     next = (next + 1) % NAME_HASH_SIZE) {
+		unsigned home = hash_name(root_dir_block[name_hash[next] - 1].filename);
+		// move the entry into the hole unless its home lies in (slot, next]
+		if ((next > slot && (home <= slot || home > next)) ||
+		    (next < slot && (home <= slot && home > next))) {
+			name_hash[slot] = name_hash[next];
+			name_hash[next] = 0;
+			slot = next;
+		}
+	}
+}
+
+
+// helper: read and write 
+static int go_to_cur_FAT_block(int cur_fat_index, int iter_amount)
+{
+	for (int i = 0; i < iter_amount; i++) {
+		if (cur_fat_index == EOC) {
+			fs_error("attempted to exceed end of file chain");
+			return -1;
+		}
+		cur_fat_index = get_FAT(cur_fat_index);
+	}
+	return cur_fat_index;
+}
+
+
+// helper: write, returns the last block of a file's chain and its length,
+// walking from the descriptor's cursor rather than from the first block
+static int get_chain_tail(int fd, int *length)
+{
+	struct file_descriptor_t *fd_obj = fd_table[fd];
+	int tail = EOC;
+	int i = get_start_block(fd_obj->file_index);
+
+	*length = 0;
+	if (fd_obj->cursor_fat_index != EOC) {
+		i = fd_obj->cursor_fat_index;
+		*length = fd_obj->cursor_block;
+	}
+
+	for (; i != EOC; i = get_FAT(i)) {
+		tail = i;
+		(*length)++;
+	}
+	if (tail != EOC)
+		set_fd_cursor(fd, *length - 1, tail);
+	return tail;
+}
+
+
+// helper: read and write, FAT index of a logical block of the file, resuming
+// from the descriptor's cursor when the block lies at or after it
+static int seek_fd_block(int fd, size_t block)
+{
+	struct file_descriptor_t *fd_obj = fd_table[fd];
+	struct block_map_t *map = fd_obj->file->block_map;
+	int fat_index = get_start_block(fd_obj->file_index);
+	size_t pos = 0;
+
+	if (fd_obj->cursor_fat_index != EOC && fd_obj->cursor_block <= block) {
+		fat_index = fd_obj->cursor_fat_index;
+		pos = fd_obj->cursor_block;
+	}
+
+	// random access: go through the block map, building it if allowed
+	if (block - pos > RANDOM_SEEK_BLOCKS) {
+		if (!map && (fd_obj->flags & FS_OPEN_RANDOM))
+			map = build_block_map(fd_obj->file_index);
+		if (map && block < map->num_blocks) {
+			set_fd_cursor(fd, block, map->blocks[block]);
+			return map->blocks[block];
+		}
+	}
+
+	fat_index = go_to_cur_FAT_block(fat_index, block - pos);
+	if (fat_index != EOC && fat_index != -1)
+		set_fd_cursor(fd, block, fat_index);
+	return fat_index;
+}
+
+
+// helper: random access, record a file's chain in a flat array
+static struct block_map_t *build_block_map(int file_index)
+{
+	struct block_map_t *map = malloc(sizeof(struct block_map_t));
+	size_t num_blocks = 0;
+	int start = get_start_block(file_index);
+
+	if (!map)
+		return NULL;
+
+	for (int i = start; i != EOC; i = get_FAT(i))
+		num_blocks++;
+
+	map->num_blocks = num_blocks;
+	map->blocks = malloc((num_blocks ? num_blocks : 1) * sizeof(uint32_t));
+	if (!map->blocks) {
+		free(map);
+		return NULL;
+	}
+
+	num_blocks = 0;
+	for (int i = start; i != EOC; i = get_FAT(i))
+		map->blocks[num_blocks++] = i;
+
+	open_files[file_index]->block_map = map;
+	return map;
+}
+
+
+// helper: a file's chain changed or the file is gone
+static void drop_block_map(int file_index)
+{
+	struct open_file_t *file = open_files[file_index];
+
+	if (!file || !file->block_map)
+		return;
+	free(file->block_map->blocks);
+	free(file->block_map);
+	file->block_map = NULL;
+}
+
+
+static void set_fd_cursor(int fd, size_t block, int fat_index)
+{
+	fd_table[fd]->cursor_block = block;
+	fd_table[fd]->cursor_fat_index = fat_index;
+}
+
+
+// helper: read and write, length of the run of physically consecutive blocks
+// starting at fat_index (at most max_blocks)
+static int contiguous_run(int fat_index, int max_blocks, int *next_index)
+{
+	int run = 1;
+
+	while (run < max_blocks && get_FAT(fat_index) == fat_index + 1) {
+		fat_index++;
+		run++;
+	}
+	*next_index = get_FAT(fat_index);
+	return run;
+}
+
+
+// helper: write, fetch the current contents of a block about to be partially
+// overwritten (blocks past the end of the file start out zeroed)
+static int load_partial_block(char *dst, size_t block, int fat_index, size_t file_size)
+{
+	if (block * BLOCK_SIZE < file_size)
+		return cache_read(fat_index + vol.data_start_index, dst);
+	memset(dst, 0, BLOCK_SIZE);
+	return 0;
+}
+
+
+// helper: read, copy len bytes starting location bytes into the run of
+// consecutive blocks at fat_index out to dst. Whole blocks go straight into
+// the destination buffers, as many per request as a buffer can take; only a
+// partial first or last block, or one straddling two buffers, goes through
+// io_buff.
+static int read_run(int fat_index, size_t location, struct iov_iter *dst, size_t len,
+                    char *io_buff)
+{
+	size_t disk_block = fat_index + vol.data_start_index;
+	size_t first = 0;
+	size_t end = (location + len) / BLOCK_SIZE;
+
+	if (location != 0 || len < BLOCK_SIZE) {
+		size_t part = BLOCK_SIZE - location;
+		if (part > len)
+			part = len;
+		if (cache_read(disk_block, io_buff) < 0)
+			return -1;
+		iov_scatter(dst, io_buff + location, part);
+		len -= part;
+		first = 1;
+	}
+
+	while (first < end) {
+		char *ptr;
+		size_t n = iov_contig(dst, &ptr) / BLOCK_SIZE;
+
+		if (n > end - first)
+			n = end - first;
+		if (n == 0) {
+			if (cache_read(disk_block + first, io_buff) < 0)
+				return -1;
+			iov_scatter(dst, io_buff, BLOCK_SIZE);
+			n = 1;
+		} else {
+			if (cache_read_range(disk_block + first, n, ptr) < 0)
+				return -1;
+			iov_advance(dst, n * BLOCK_SIZE);
+		}
+		first += n;
+		len -= n * BLOCK_SIZE;
+	}
+
+	if (len > 0) {
+		if (cache_read(disk_block + end, io_buff) < 0)
+			return -1;
+		iov_scatter(dst, io_buff, len);
+	}
+	return 0;
+}
+
+
+// helper: write, store len bytes taken from src at location bytes into the run
+// of consecutive blocks at fat_index (logical block number block). Whole
+// blocks go out straight from the source buffers, as many per request as a
+// buffer holds; a block straddling two buffers is assembled in io_buff, and a
+// partial first or last block is merged there with its current contents.
+static int write_run(int fat_index, size_t block, size_t location, struct iov_iter *src,
+                     size_t len, size_t file_size, char *io_buff)
+{
+	size_t disk_block = fat_index + vol.data_start_index;
+	size_t first = 0;
+	size_t end = (location + len) / BLOCK_SIZE;
+
+	if (location != 0 || len < BLOCK_SIZE) {
+		size_t part = BLOCK_SIZE - location;
+		if (part > len)
+			part = len;
+		if (load_partial_block(io_buff, block, fat_index, file_size) < 0)
+			return -1;
+		iov_gather(src, io_buff + location, part);
+		if (cache_write(disk_block, io_buff) < 0)
+			return -1;
+		len -= part;
+		first = 1;
+	}
+
+	while (first < end) {
+		char *ptr;
+		size_t n = iov_contig(src, &ptr) / BLOCK_SIZE;
+		int ret;
+
+		if (n > end - first)
+			n = end - first;
+		// single blocks stay in the write-back cache, runs go out in one call
+		if (n == 0) {
+			iov_gather(src, io_buff, BLOCK_SIZE);
+			ret = cache_write(disk_block + first, io_buff);
+			n = 1;
+		} else if (n == 1) {
+			ret = cache_write(disk_block + first, ptr);
+			iov_advance(src, BLOCK_SIZE);
+		} else {
+			ret = cache_write_range(disk_block + first, n, ptr);
+			iov_advance(src, n * BLOCK_SIZE);
+		}
+		if (ret < 0)
+			return -1;
+		first += n;
+		len -= n * BLOCK_SIZE;
+	}
+
+	if (len > 0) {
+		if (load_partial_block(io_buff, block + end, fat_index + end, file_size) < 0)
+			return -1;
+		iov_gather(src, io_buff, len);
+		if (cache_write(disk_block + end, io_buff) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+
+// helper: vectored transfers, total length of a list of buffers
+static size_t iov_length(const struct iovec *iov, int iovcnt)
+{
+	size_t len = 0;
+
+	for (int i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	return len;
+}
+
+
+// helper: vectored transfers, bytes left in the current buffer (empty buffers
+// skipped) and where they start
+static size_t iov_contig(struct iov_iter *it, char **ptr)
+{
+	while (it->iovcnt > 0 && it->skip == it->iov->iov_len) {
+		it->iov++;
+		it->iovcnt--;
+		it->skip = 0;
+	}
+	if (it->iovcnt == 0)
+		return 0;
+	*ptr = (char *)it->iov->iov_base + it->skip;
+	return it->iov->iov_len - it->skip;
+}
+
+
+// helper: vectored transfers, move past len bytes
+static void iov_advance(struct iov_iter *it, size_t len)
+{
+	while (len > 0) {
+		char *ptr = NULL;
+		size_t n = iov_contig(it, &ptr);
+		if (n == 0)
+			break;  // buffers exhausted
+		if (n > len)
+			n = len;
+		it->skip += n;
+		len -= n;
+	}
+}
+
+
+// helper: vectored transfers, copy the next len bytes of the buffers to dst
+static void iov_gather(struct iov_iter *it, char *dst, size_t len)
+{
+	while (len > 0) {
+		char *ptr = NULL;
+		size_t n = iov_contig(it, &ptr);
+		if (n == 0)
+			break;  // buffers exhausted
+		if (n > len)
+			n = len;
+		memcpy(dst, ptr, n);
+		it->skip += n;
+		dst += n;
+		len -= n;
+	}
+}
+
+
+// helper: vectored transfers, copy len bytes from src to the next buffers
+static void iov_scatter(struct iov_iter *it, const char *src, size_t len)
+{
+	while (len > 0) {
+		char *ptr = NULL;
+		size_t n = iov_contig(it, &ptr);
+		if (n == 0)
+			break;  // buffers exhausted
+		if (n > len)
+			n = len;
+		memcpy(ptr, src, n);
+		it->skip += n;
+		src += n;
+		len -= n;
+	}
+}
+
+
+// helper: read and write, borrow a staging buffer
+static char *get_io_buff(void)
+{
+	if (io_pool_len > 0)
+		return io_pool[--io_pool_len];
+	return malloc(BLOCK_SIZE);
+}
+
+
+// helper: write, grow a file's chain from chain_len to needed blocks, or by as
+// many blocks as are left on disk, in as few contiguous runs as possible; tail
+// is the chain's last block. Blocks set aside for delayed allocation are left
+// alone. Returns the new chain length.
+static int extend_chain(int file_index, int tail, int chain_len, int needed)
+{
+	while (chain_len < needed && (size_t)num_free_blocks > num_staged_blocks) {
+		// prefer the blocks right after the current tail
+		int got;
+		int want = needed - chain_len;
+		if ((size_t)want > num_free_blocks - num_staged_blocks)
+			want = num_free_blocks - num_staged_blocks;
+		int j = alloc_extent(tail == EOC ? -1 : tail + 1, want, &got);
+		if (j < 0)
+			break;
+		for (int k = j; k < j + got; k++) {
+			if (tail == EOC) {
+				set_start_block(file_index, k);
+			} else {
+				set_FAT(tail, k);
+			}
+			tail = k;
+		}
+		set_FAT(tail, EOC);
+		chain_len += got;
+		drop_block_map(file_index);
+	}
+	return chain_len;
+}
+
+
+// helper: write, delayed allocation, make sure blocks [chain_len, needed) of
+// a file are staged, as far as free disk blocks can be set aside for them.
+// Returns the number of blocks of the file, chain and staged ones.
+static size_t stage_blocks(int file_index, size_t chain_len, size_t needed)
+{
+	struct staged_t *st = staged[file_index];
+	size_t have = st ? st->num_blocks : 0;
+	size_t want = needed - chain_len;
+	size_t avail = (size_t)num_free_blocks > num_staged_blocks ?
+	               num_free_blocks - num_staged_blocks : 0;
+
+	if (want <= have)
+		return needed;
+	if (want - have > avail)
+		want = have + avail;
+	if (want == have)
+		return chain_len + have;
+
+	if (!st) {
+		if (!(st = calloc(1, sizeof(struct staged_t))))
+			return chain_len;
+		st->first_block = chain_len;
+		staged[file_index] = st;
+	}
+	if (want > st->max_blocks) {
+		size_t max_blocks = want > 2 * st->max_blocks ? want : 2 * st->max_blocks;
+		char *data = realloc(st->data, max_blocks * BLOCK_SIZE);
+		if (!data)
+			return chain_len + have;
+		st->data = data;
+		st->max_blocks = max_blocks;
+	}
+
+	// blocks past the end of the file start out zeroed
+	memset(st->data + have * BLOCK_SIZE, 0, (want - have) * BLOCK_SIZE);
+	st->num_blocks = want;
+	num_staged_blocks += want - have;
+	return chain_len + want;
+}
+
+
+// helper: delayed allocation, link a file's staged blocks into its chain, in
+// one batch so that they stay contiguous, and write them out
+static int flush_staged(int file_index)
+{
+	struct staged_t *st = staged[file_index];
+	struct rootdirectory_t *the_dir = file_entry(file_index);
+	int ret = 0;
+
+	if (!st || st->flushing)
+		return 0;
+	st->flushing = true;
+
+	int tail = EOC;
+	if (st->first_block > 0)
+		tail = go_to_cur_FAT_block(get_start_block(file_index), st->first_block - 1);
+
+	// the free blocks set aside for them are now taken for real
+	num_staged_blocks -= st->num_blocks;
+	size_t chain_len = extend_chain(file_index, tail, st->first_block,
+	                                st->first_block + st->num_blocks);
+	if (chain_len != st->first_block + st->num_blocks) {
+		fs_error("no room left for the data of @[%s]", the_dir->filename);
+		if (the_dir->file_size > chain_len * BLOCK_SIZE) {
+			the_dir->file_size = chain_len * BLOCK_SIZE;
+			entry_dirty(file_index);
+		}
+		ret = -1;
+	}
+
+	// one request per contiguous run, usually a single one
+	int fat_index = tail == EOC ? get_start_block(file_index) : get_FAT(tail);
+	size_t done = 0;
+	size_t total = chain_len - st->first_block;
+	while (done < total) {
+		int next_index;
+		int run = contiguous_run(fat_index, total - done, &next_index);
+		size_t disk_block = fat_index + vol.data_start_index;
+		char *src = st->data + done * BLOCK_SIZE;
+
+		if ((run == 1 ? cache_write(disk_block, src)
+		              : cache_write_range(disk_block, run, src)) < 0) {
+			fs_error("failure to write to block \n");
+			ret = -1;
+			break;
+		}
+		done += run;
+		fat_index = next_index;
+	}
+
+	staged[file_index] = NULL;
+	free(st->data);
+	free(st);
+	return ret;
+}
+
+
+// helper: delayed allocation, flush the staged blocks of every file
+static int flush_all_staged(void)
+{
+	int ret = 0;
+
+	for (int i = 0; i < num_file_slots; i++)
+		if (flush_staged(i) < 0)
+			ret = -1;
+	return ret;
+}
+
+
+// helper: read, grow the readahead window of a descriptor while each read
+// starts where the previous one ended, drop it on any other access
+static void update_readahead(int fd, size_t offset, size_t len)
+{
+	struct file_descriptor_t *fd_obj = fd_table[fd];
+
+	if (fd_obj->flags & FS_OPEN_RANDOM)
+		return;
+
+	if (offset == fd_obj->ra_next_off) {
+		fd_obj->ra_window = fd_obj->ra_window ? 2 * fd_obj->ra_window : RA_MIN_BLOCKS;
+		if (fd_obj->ra_window > ra_max_blocks)
+			fd_obj->ra_window = ra_max_blocks;
+	} else {
+		fd_obj->ra_window = 0;
+		fd_obj->ra_end = 0;
+	}
+	fd_obj->ra_next_off = offset + len;
+}
+
+
+// helper: read, prefetch the window of blocks starting at logical block
+// block (at FAT index fat_index), skipping the ones already prefetched. A
+// failed prefetch is not an error, the blocks are simply read on demand.
+static void readahead(int fd, size_t block, int fat_index)
+{
+	struct file_descriptor_t *fd_obj = fd_table[fd];
+	struct rootdirectory_t *the_dir = file_entry(fd_obj->file_index);
+	size_t file_size = the_dir->file_size;
+	size_t end = block + fd_obj->ra_window;
+
+	if (end > (file_size + BLOCK_SIZE - 1) / BLOCK_SIZE)
+		end = (file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	// and so is a packed tail, outside of the chain
+	if (the_dir->tail_block && end > file_size / BLOCK_SIZE)
+		end = file_size / BLOCK_SIZE;
+	// staged blocks are in memory already
+	if (staged[fd_obj->file_index] && end > staged[fd_obj->file_index]->first_block)
+		end = staged[fd_obj->file_index]->first_block;
+	if (fd_obj->ra_end > block) {
+		if (fd_obj->ra_end >= end)
+			return;
+		fat_index = go_to_cur_FAT_block(fat_index, fd_obj->ra_end - block);
+		block = fd_obj->ra_end;
+	}
+	fd_obj->ra_end = end;
+
+	while (block < end && fat_index != EOC && fat_index != -1) {
+		int next_index;
+		int run = contiguous_run(fat_index, end - block, &next_index);
+
+		if (cache_prefetch(fat_index + vol.data_start_index, run) < 0)
+			return;
+		block += run;
+		fat_index = next_index;
+	}
+}
+
+
+// helper: write, append to the descriptor's write buffer, which is handed to
+// the file every time it reaches the end of a block
+static int buffer_write(int fd, const char *buf, size_t count)
+{
+	struct file_descriptor_t *fd_obj = fd_table[fd];
+	size_t done = 0;
+
+	while (done < count) {
+		if (fd_obj->wbuf_len == 0)
+			fd_obj->wbuf_off = fd_obj->offset;
+
+		size_t room = BLOCK_SIZE - fd_obj->wbuf_off % BLOCK_SIZE - fd_obj->wbuf_len;
+		size_t n = count - done < room ? count - done : room;
+
+		memcpy(fd_obj->wbuf + fd_obj->wbuf_len, buf + done, n);
+		fd_obj->wbuf_len += n;
+		fd_obj->offset += n;
+		done += n;
+
+		if (n == room && flush_wbuf(fd) < 0)
+			return -1;
+	}
+	return done;
+}
+
+
+// helper: write out a descriptor's write buffer. The buffer is swapped for a
+// fresh one first, so that the descriptor can keep buffering while the
+// write is parked on disk I/O.
+static int flush_wbuf(int fd)
+{
+	struct file_descriptor_t *fd_obj = fd_table[fd];
+	size_t len = fd_obj->wbuf_len;
+
+	if (len == 0)
+		return 0;
+
+	char *fresh = get_io_buff();
+	if (!fresh) {
+		fs_error("failure to allocate write buffer");
+		return -1;
+	}
+	struct iovec iov = { .iov_base = fd_obj->wbuf, .iov_len = len };
+	fd_obj->wbuf = fresh;
+	fd_obj->wbuf_len = 0;
+
+	int ret = write_iov(fd, &iov, 1, fd_obj->wbuf_off);
+	put_io_buff(iov.iov_base);
+	if (ret != (int)len) {
+		fs_error("could only write %d of %zu buffered bytes to @[%s]",
+		         ret < 0 ? 0 : ret, len, file_entry(fd_obj->file_index)->filename);
+		return -1;
+	}
+	return 0;
+}
+
+
+// helper: read and write, give a staging buffer back for later calls
+static void put_io_buff(char *io_buff)
+{
+	if (!io_buff)
+		return;
+	if (io_pool_len < FS_OPEN_MAX_COUNT)
+		io_pool[io_pool_len++] = io_buff;
+	else
+		free(io_buff);
+}
+
+
+// helper: the directory entry of a file slot
+static struct rootdirectory_t *file_entry(int file_index)
+{
+	if (file_index < FS_FILE_MAX_COUNT)
+		return &root_dir_block[file_index];
+	return &open_files[file_index]->entry;
+}
+
+
+static void entry_dirty(int file_index)
+{
+	if (file_index < FS_FILE_MAX_COUNT)
+		root_dir_dirty = true;
+	else
+		open_files[file_index]->dirty = true;
+}
+
+
+// helper: directories, one thread at a time in the trees
+static void lock_dirs(void)
+{
+	while (dirs_busy)
+		uthread_yield();
+	dirs_busy = true;
+}
+
+
+static void unlock_dirs(void)
+{
+	dirs_busy = false;
+}
+
+
+// helper: directories, find the directory holding the last component of path
+// ('/'-separated, from the root directory whether it starts with '/' or not)
+// and copy that component to name
+static int resolve_path(const char *path, int *dir, char *name)
+{
+	int cur = ROOT_DIR;
+
+	while (*path == '/')
+		path++;
+
+	for (;;) {
+		const char *end = strchr(path, '/');
+		size_t len = end ? (size_t)(end - path) : strlen(path);
+
+		if (len == 0 || len >= FS_FILENAME_LEN) {
+			fs_error("invalid file name in path @[%s]\n", path);
+			return -1;
+		}
+		memcpy(name, path, len);
+		name[len] = '\0';
+		if (!end)
+			break;
+
+		struct rootdirectory_t entry;
+		if (find_entry(cur, name, &entry, NULL) < 0 || entry.type != ENTRY_DIR) {
+			fs_error("no directory @[%s]\n", name);
+			return -1;
+		}
+		cur = entry_start(&entry);
+		path = end + 1;
+	}
+
+	*dir = cur;
+	return 0;
+}
+
+
+// helper: directories, copy the entry of name in dir, along with its slot for
+// the root directory
+static int find_entry(int dir, const char *name, struct rootdirectory_t *entry, int *file_index)
+{
+	if (dir != ROOT_DIR)
+		return dir_lookup(dir, name, entry);
+
+	int i = locate_file(name);
+	if (i < 0)
+		return -1;
+	*entry = root_dir_block[i];
+	if (file_index)
+		*file_index = i;
+	return 0;
+}
+
+
+// helper: create, mkdir, add an entry starting at the given block
+static int create_entry(int dir, const char *name, int type, int start)
+{
+	if (dir != ROOT_DIR) {
+		struct rootdirectory_t entry;
+
+		memset(&entry, 0, sizeof(entry));
+		strcpy(entry.filename, name);
+		entry.type = type;
+		set_entry_start(&entry, start);
+		return dir_insert(dir, &entry);
+	}
+
+	// perform error checking first 
+	if (error_free(name) == false) {
+		fs_error("error associated with filename");
+		return -1;
+	}
+
+	// finds first available empty file
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (root_dir_block[i].filename[0] == EMPTY) {
+			memset(&root_dir_block[i], 0, sizeof(struct rootdirectory_t));
+			strcpy(root_dir_block[i].filename, name);
+			root_dir_block[i].type = type;
+			set_start_block(i, start);
+			name_hash_insert(i);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+
+// helper: delete, rmdir, free an entry's blocks and remove it from dir
+static int delete_entry(int dir, const char *name, int type)
+{
+	struct rootdirectory_t entry;
+	int file_index = -1;
+
+	if (find_entry(dir, name, &entry, &file_index) < 0) {
+		fs_error("file @[%s] doesnt exist\n", name);
+		return -1;
+	}
+	if (entry.type != type) {
+		if (type == ENTRY_DIR)
+			fs_error("@[%s] is not a directory\n", name);
+		else
+			fs_error("@[%s] is a directory\n", name);
+		return -1;
+	}
+	if (dir == ROOT_DIR ? is_open(name) : sub_slot(dir, name) >= 0) {
+		fs_error("file currently open");
+		return -1;
+	}
+	// closed, but its tail may still be on the move
+	while (dir == ROOT_DIR && packing_index == file_index)
+		uthread_yield();
+	if (dir == ROOT_DIR)
+		entry = root_dir_block[file_index];
+
+	int frst_dta_blk_i = entry_start(&entry);
+	if (type == ENTRY_DIR) {
+		if (!dir_empty(frst_dta_blk_i)) {
+			fs_error("directory @[%s] is not empty\n", name);
+			return -1;
+		}
+		if (dir_listed(frst_dta_blk_i)) {
+			fs_error("directory @[%s] is being listed\n", name);
+			return -1;
+		}
+		if (free_dir_tree(frst_dta_blk_i) < 0)
+			return -1;
+	}
+	while (type == ENTRY_FILE && frst_dta_blk_i != EOC) {
+		int tmp = get_FAT(frst_dta_blk_i);
+		release_block(frst_dta_blk_i);
+		frst_dta_blk_i = tmp;
+	}
+	if (entry.tail_block) {
+		lock_frags();
+		int ret = frag_free(entry.tail_block, entry.tail_offset, entry.file_size % BLOCK_SIZE);
+		unlock_frags();
+		if (ret < 0)
+			return -1;
+	}
+
+	if (dir != ROOT_DIR)
+		return dir_remove(dir, name);
+
+	// reset file to blank slate
+	struct rootdirectory_t *the_dir = &root_dir_block[file_index];
+	drop_block_map(file_index);
+	name_hash_remove(file_index);
+	memset(the_dir->filename, 0, FS_FILENAME_LEN);
+	the_dir->file_size = 0;
+	the_dir->tail_block = 0;
+	the_dir->flags = 0;
+	root_dir_dirty = true;
+
+	return 0;
+}
+
+
+// helper: open, slot of a subdirectory's file that is already open
+static int sub_slot(int dir, const char *name)
+{
+	for (int i = FS_FILE_MAX_COUNT; i < num_file_slots; i++)
+		if (open_files[i] && open_files[i]->dir == dir &&
+		    strncmp(open_files[i]->entry.filename, name, FS_FILENAME_LEN) == 0)
+			return i;
+	return -1;
+}
+
+
+// helper: open, slot of the file name in dir, with its open file object,
+// which is new if the file is not open yet
+static int get_file_slot(int dir, const char *name)
+{
+	struct rootdirectory_t entry;
+	struct open_file_t *file;
+	int file_index = -1;
+
+	if (dir != ROOT_DIR && (file_index = sub_slot(dir, name)) >= 0)
+		return file_index;
+
+	if (find_entry(dir, name, &entry, &file_index) < 0)
+		return -1;
+	if (entry.type == ENTRY_DIR) {
+		fs_error("@[%s] is a directory\n", name);
+		return -1;
+	}
+	if (dir == ROOT_DIR && open_files[file_index])
+		return file_index;
+
+	// a subdirectory's file takes the first free slot past the root directory
+	if (dir != ROOT_DIR) {
+		file_index = FS_FILE_MAX_COUNT;
+		while (file_index < num_file_slots && open_files[file_index])
+			file_index++;
+		if (file_index == num_file_slots && grow_file_slots() < 0)
+			return -1;
+	}
+
+	if (!(file = calloc(1, sizeof(struct open_file_t))))
+		return -1;
+	if (dir != ROOT_DIR) {
+		file->dir   = dir;
+		file->entry = entry;
+	}
+	open_files[file_index] = file;
+	return file_index;
+}
+
+
+// helper: open, double the slots for the open files of subdirectories
+static int grow_file_slots(void)
+{
+	int num = FS_FILE_MAX_COUNT + 2 * (num_file_slots - FS_FILE_MAX_COUNT);
+	struct open_file_t **files = realloc(open_files, num * sizeof(*files));
+
+	if (!files)
+		return -1;
+	open_files = files;
+
+	struct staged_t **st = realloc(staged, num * sizeof(*st));
+	if (!st)
+		return -1;
+	staged = st;
+
+	memset(open_files + num_file_slots, 0, (num - num_file_slots) * sizeof(*files));
+	memset(staged + num_file_slots, 0, (num - num_file_slots) * sizeof(*st));
+	num_file_slots = num;
+	return 0;
+}
+
+
+// helper: close, once no descriptor uses a file, write back its entry if it
+// is in a subdirectory and release its open file object
+static int put_file_slot(int file_index)
+{
+	struct open_file_t *file = open_files[file_index];
+	int ret = 0;
+
+	lock_dirs();
+	if (!file || file->refs > 0) {
+		unlock_dirs();
+		return 0;
+	}
+	if (file_index >= FS_FILE_MAX_COUNT && file->dirty &&
+	    dir_update(file->dir, &file->entry) < 0)
+		ret = -1;
+	drop_block_map(file_index);
+	open_files[file_index] = NULL;
+	free(file);
+	unlock_dirs();
+
+	return ret;
+}
+
+
+// helper: sync, copy the changed entries of open files back to their directory
+static int write_sub_entries(void)
+{
+	int ret = 0;
+
+	for (int i = FS_FILE_MAX_COUNT; i < num_file_slots; i++) {
+		struct open_file_t *file = open_files[i];
+		if (!file || !file->dirty)
+			continue;
+		if (dir_update(file->dir, &file->entry) < 0)
+			ret = -1;
+		else
+			file->dirty = false;
+	}
+	return ret;
+}
+
+
+// helper: fragmentation, a new extent starts at every link that is not to the
+// next block
+static void chain_frag_stats(int fat_index, struct fs_frag_stats *stats)
+{
+	int prev = EOC;
+
+	for (int b = fat_index; b != EOC; b = get_FAT(b)) {
+		if (prev == EOC || b != prev + 1)
+			stats->file_extents++;
+		stats->file_blocks++;
+		prev = b;
+	}
+}
+
+
+// helper: fragmentation, the nodes of a directory tree (one block each) and
+// the files below them
+static int dir_frag_stats(int block, struct fs_frag_stats *stats)
+{
+	struct dir_node_t *node = (struct dir_node_t *)get_io_buff();
+	int ret = 0;
+
+	if (!node || read_node(block, node) < 0) {
+		put_io_buff((char *)node);
+		return -1;
+	}
+
+	stats->file_blocks++;
+	stats->file_extents++;
+	if (node->type == DIR_INTERNAL) {
+		for (int i = 0; i <= node->num; i++) {
+			int child = i == 0 ? (int)node->link : (int)node->keys[i - 1].child;
+			if (dir_frag_stats(child, stats) < 0)
+				ret = -1;
+		}
+	} else {
+		for (int i = 0; i < node->num; i++) {
+			int start = entry_start(&node->entries[i]);
+			if (node->entries[i].type != ENTRY_DIR)
+				chain_frag_stats(start, stats);
+			else if (dir_frag_stats(start, stats) < 0)
+				ret = -1;
+		}
+	}
+
+	put_io_buff((char *)node);
+	return ret;
+}
+
+
+// helper: directory trees, nodes go through the block cache like file data
+static int read_node(int block, struct dir_node_t *node)
+{
+	if (cache_read(block + vol.data_start_index, node) < 0) {
+		fs_error("failure to read from block \n");
+		return -1;
+	}
+	return 0;
+}
+
+
+static int write_node(int block, const struct dir_node_t *node)
+{
+	if (cache_write(block + vol.data_start_index, node) < 0) {
+		fs_error("failure to write to block \n");
+		return -1;
+	}
+	return 0;
+}
+
+
+// helper: directory trees, fragment blocks, take a block for a new node (a
+// chain of its own) near goal, leaving alone the ones set aside for delayed
+// allocation
+static int alloc_node(int goal)
+{
+	int got;
+
+	if (load_free_map() < 0)
+		return -1;
+	if ((size_t)num_free_blocks <= num_staged_blocks) {
+		fs_error("no free block left");
+		return -1;
+	}
+
+	int block = alloc_extent(goal + 1, 1, &got);
+	if (block < 0)
+		return -1;
+	set_FAT(block, EOC);
+	return block;
+}
+
+
+// helper: directory trees, position of the first leaf entry not below name
+static int leaf_find(const struct dir_node_t *node, const char *name, bool *found)
+{
+	int lo = 0, hi = node->num;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (strncmp(node->entries[mid].filename, name, FS_FILENAME_LEN) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	*found = lo < node->num &&
+	         strncmp(node->entries[lo].filename, name, FS_FILENAME_LEN) == 0;
+	return lo;
+}
+
+
+// helper: directory trees, child of an internal node covering name; pos gets
+// the number of keys not above name, where a key for a split child goes
+static int node_child(const struct dir_node_t *node, const char *name, int *pos)
+{
+	int lo = 0, hi = node->num;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (strncmp(node->keys[mid].name, name, FS_FILENAME_LEN) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (pos)
+		*pos = lo;
+	return lo == 0 ? node->link : node->keys[lo - 1].child;
+}
+
+
+// helper: directory trees, read the leaf where name belongs into node
+static int dir_descend(int dir, const char *name, struct dir_node_t *node)
+{
+	int block = dir;
+
+	for (int depth = 0; ; depth++) {
+		if (read_node(block, node) < 0)
+			return -1;
+		if (node->type == DIR_LEAF)
+			return block;
+		if (node->type != DIR_INTERNAL || depth == DIR_MAX_DEPTH) {
+			fs_error("corrupted directory block %d", block);
+			return -1;
+		}
+		block = node_child(node, name, NULL);
+	}
+}
+
+
+static int dir_lookup(int dir, const char *name, struct rootdirectory_t *entry)
+{
+	struct dir_node_t *node = (struct dir_node_t *)get_io_buff();
+	bool found = false;
+
+	if (!node)
+		return -1;
+	if (dir_descend(dir, name, node) >= 0) {
+		int pos = leaf_find(node, name, &found);
+		if (found)
+			*entry = node->entries[pos];
+	}
+	put_io_buff((char *)node);
+	return found ? 0 : -1;
+}
+
+
+// helper: directory trees, replace the entry of the same name
+static int dir_update(int dir, const struct rootdirectory_t *entry)
+{
+	struct dir_node_t *node = (struct dir_node_t *)get_io_buff();
+	int ret = -1;
+
+	if (!node)
+		return -1;
+	int block = dir_descend(dir, entry->filename, node);
+	if (block >= 0) {
+		bool found;
+		int pos = leaf_find(node, entry->filename, &found);
+		if (found) {
+			node->entries[pos] = *entry;
+			ret = write_node(block, node);
+		}
+	}
+	put_io_buff((char *)node);
+	return ret;
+}
+
+
+static int dir_remove(int dir, const char *name)
+{
+	struct dir_node_t *node = (struct dir_node_t *)get_io_buff();
+	int ret = -1;
+
+	if (!node)
+		return -1;
+	int block = dir_descend(dir, name, node);
+	if (block >= 0) {
+		bool found;
+		int pos = leaf_find(node, name, &found);
+		if (found) {
+			memmove(&node->entries[pos], &node->entries[pos + 1],
+			        (node->num - pos - 1) * sizeof(struct rootdirectory_t));
+			node->num--;
+			ret = write_node(block, node);
+		}
+	}
+	put_io_buff((char *)node);
+	return ret;
+}
+
+
+// helper: directory trees, add an entry; when the root node splits, its left
+// half moves to a new block and it becomes their parent
+static int dir_insert(int dir, const struct rootdirectory_t *entry)
+{
+	char sep[FS_FILENAME_LEN];
+	int new_block;
+
+	// room for a split at every level
+	if (load_free_map() < 0)
+		return -1;
+	if ((size_t)num_free_blocks < num_staged_blocks + DIR_MAX_DEPTH) {
+		fs_error("no room left for directory entry @[%s]", entry->filename);
+		return -1;
+	}
+
+	int ret = node_insert(dir, entry, sep, &new_block);
+	if (ret <= 0)
+		return ret;
+
+	int left = alloc_node(dir);
+	struct dir_node_t *node = (struct dir_node_t *)get_io_buff();
+	ret = -1;
+	if (left >= 0 && node && read_node(dir, node) == 0 && write_node(left, node) == 0) {
+		memset(node, 0, BLOCK_SIZE);
+		node->type = DIR_INTERNAL;
+		node->link = left;
+		key_put(node, 0, sep, new_block);
+		ret = write_node(dir, node);
+	}
+	put_io_buff((char *)node);
+	return ret;
+}
+
+
+// helper: directory trees, insert below block; returns 1 when the node split,
+// with the first name of the new right half in sep and its block in new_block
+static int node_insert(int block, const struct rootdirectory_t *entry, char *sep, int *new_block)
+{
+	struct dir_node_t *node = (struct dir_node_t *)get_io_buff();
+	struct dir_node_t *right = NULL;
+	char child_sep[FS_FILENAME_LEN];
+	int child_block;
+	int pos, ret = -1;
+
+	if (!node)
+		return -1;
+	if (read_node(block, node) < 0)
+		goto out;
+
+	if (node->type == DIR_LEAF) {
+		bool found;
+		pos = leaf_find(node, entry->filename, &found);
+		if (found) {
+			fs_error("file @[%s] already exists\n", entry->filename);
+			goto out;
+		}
+		if (node->num < DIR_LEAF_MAX) {
+			leaf_put(node, pos, entry);
+			ret = write_node(block, node);
+			goto out;
+		}
+	} else {
+		int child = node_child(node, entry->filename, &pos);
+		ret = node_insert(child, entry, child_sep, &child_block);
+		if (ret <= 0)
+			goto out;
+		if (node->num < DIR_KEY_MAX) {
+			key_put(node, pos, child_sep, child_block);
+			ret = write_node(block, node);
+			goto out;
+		}
+	}
+
+	// full node: move its upper half to a new one, then insert in the half
+	// where the new entry or key belongs
+	ret = -1;
+	int right_block = alloc_node(block);
+	if (right_block < 0 || !(right = (struct dir_node_t *)get_io_buff()))
+		goto out;
+	memset(right, 0, BLOCK_SIZE);
+	right->type = node->type;
+
+	int half = node->num / 2;
+	if (node->type == DIR_LEAF) {
+		right->num  = node->num - half;
+		right->link = node->link;
+		memcpy(right->entries, &node->entries[half],
+		       right->num * sizeof(struct rootdirectory_t));
+		node->num  = half;
+		node->link = right_block;
+		if (pos <= half)
+			leaf_put(node, pos, entry);
+		else
+			leaf_put(right, pos - half, entry);
+		memcpy(sep, right->entries[0].filename, FS_FILENAME_LEN);
+	} else {
+		// the middle key moves up, its child starts the right half
+		right->num  = node->num - half - 1;
+		right->link = node->keys[half].child;
+		memcpy(right->keys, &node->keys[half + 1], right->num * sizeof(struct dir_key_t));
+		memcpy(sep, node->keys[half].name, FS_FILENAME_LEN);
+		node->num = half;
+		if (pos <= half)
+			key_put(node, pos, child_sep, child_block);
+		else
+			key_put(right, pos - half - 1, child_sep, child_block);
+	}
+
+	if (write_node(right_block, right) == 0 && write_node(block, node) == 0) {
+		*new_block = right_block;
+		ret = 1;
+	}
+
+out:
+	put_io_buff((char *)right);
+	put_io_buff((char *)node);
+	return ret;
+}
+
+
+static void leaf_put(struct dir_node_t *node, int pos, const struct rootdirectory_t *entry)
+{
+	memmove(&node->entries[pos + 1], &node->entries[pos],
+	        (node->num - pos) * sizeof(struct rootdirectory_t));
+	node->entries[pos] = *entry;
+	node->num++;
+}
+
+
+static void key_put(struct dir_node_t *node, int pos, const char *name, int child)
+{
+	memmove(&node->keys[pos + 1], &node->keys[pos],
+	        (node->num - pos) * sizeof(struct dir_key_t));
+	memcpy(node->keys[pos].name, name, FS_FILENAME_LEN);
+	node->keys[pos].child = child;
+	node->num++;
+}
+
+
+// helper: rmdir, whether every leaf of a tree is empty
+static int dir_empty(int dir)
+{
+	struct dir_node_t *node = (struct dir_node_t *)get_io_buff();
+	int block = dir;
+	int empty = 0;
+
+	if (!node)
+		return 0;
+	// leftmost leaf, then along the leaf list
+	for (;;) {
+		if (read_node(block, node) < 0)
+			break;
+		if (node->type == DIR_INTERNAL) {
+			block = node->link;
+			continue;
+		}
+		if (node->num > 0)
+			break;
+		if (node->link == 0) {
+			empty = 1;
+			break;
+		}
+		block = node->link;
+	}
+	put_io_buff((char *)node);
+	return empty;
+}
+
+
+// helper: rmdir, give back the blocks of a tree's nodes
+static int free_dir_tree(int block)
+{
+	struct dir_node_t *node = (struct dir_node_t *)get_io_buff();
+	int ret = 0;
+
+	if (!node || read_node(block, node) < 0) {
+		put_io_buff((char *)node);
+		return -1;
+	}
+	if (node->type == DIR_INTERNAL) {
+		for (int i = 0; i <= node->num; i++) {
+			int child = i == 0 ? (int)node->link : (int)node->keys[i - 1].child;
+			if (free_dir_tree(child) < 0)
+				ret = -1;
+		}
+	}
+	put_io_buff((char *)node);
+	release_block(block);
+	return ret;
+}
+
+
+// helper: tail packing, record a feature in the superblock the first time the
+// volume uses it, before any data depends on it, so that implementations that
+// do not know it refuse the volume
+static int set_feature(uint8_t feature)
+{
+	if (superblock->features & feature)
+		return 0;
+
+	superblock->features |= feature;
+	if (block_write(0, (void*)superblock) < 0) {
+		superblock->features &= ~feature;
+		fs_error("failure to write to block \n");
+		return -1;
+	}
+	return 0;
+}
+
+
+// helper: close, move the partial last block of a file to a fragment block
+// and give back its own block
+static int pack_tail(int file_index)
+{
+	struct rootdirectory_t *the_dir = file_entry(file_index);
+	size_t tail_len = the_dir->file_size % BLOCK_SIZE;
+	int ret = 0;
+
+	// a file still being flushed is packed by its next close
+	if (the_dir->type != ENTRY_FILE || (the_dir->flags & ENTRY_INLINE) ||
+	    the_dir->tail_block || tail_len == 0 ||
+	    tail_len > TAIL_MAX_BYTES || staged[file_index])
+		return 0;
+
+	lock_frags();
+	packing_index = file_index;
+
+	char *buf = get_io_buff();
+	int whole = the_dir->file_size / BLOCK_SIZE;
+	int prev = whole ? go_to_cur_FAT_block(get_start_block(file_index), whole - 1) : EOC;
+	int last = whole ? get_FAT(prev) : get_start_block(file_index);
+	int block, offset;
+
+	if (!buf || prev == -1 || last == EOC || set_feature(FEATURE_TAILPACK) < 0 ||
+	    cache_read(last + vol.data_start_index, buf) < 0 ||
+	    frag_store(buf, tail_len, &block, &offset) < 0) {
+		ret = -1;
+	} else {
+		if (prev == EOC)
+			set_start_block(file_index, EOC);
+		else
+			set_FAT(prev, EOC);
+		release_block(last);
+		drop_block_map(file_index);
+		the_dir->tail_block = block;
+		the_dir->tail_offset = offset;
+		entry_dirty(file_index);
+	}
+	put_io_buff(buf);
+
+	packing_index = -1;
+	unlock_frags();
+	return ret;
+}
+
+
+// helper: write, move the packed tail of a file back to a block at the end
+// of its chain
+static int unpack_tail(int file_index)
+{
+	struct rootdirectory_t *the_dir = file_entry(file_index);
+	int ret = 0;
+
+	lock_frags();
+	// another writer may have done it while this one was waiting
+	if (!the_dir->tail_block) {
+		unlock_frags();
+		return 0;
+	}
+
+	char *buf = get_io_buff();
+	int whole = the_dir->file_size / BLOCK_SIZE;
+	int tail = whole ? go_to_cur_FAT_block(get_start_block(file_index), whole - 1) : EOC;
+	size_t tail_len = the_dir->file_size % BLOCK_SIZE;
+
+	if (!buf || tail == -1 || load_free_map() < 0) {
+		ret = -1;
+	} else if ((size_t)num_free_blocks <= num_staged_blocks) {
+		fs_error("no free block left");
+		ret = -1;
+	} else if (extend_chain(file_index, tail, whole, whole + 1) != whole + 1 ||
+	           cache_read(the_dir->tail_block + vol.data_start_index, buf) < 0) {
+		ret = -1;
+	} else {
+		int last = whole ? get_FAT(tail) : get_start_block(file_index);
+		memmove(buf, buf + the_dir->tail_offset, tail_len);
+		memset(buf + tail_len, 0, BLOCK_SIZE - tail_len);
+		if (cache_write(last + vol.data_start_index, buf) < 0 ||
+		    frag_free(the_dir->tail_block, the_dir->tail_offset, tail_len) < 0)
+			ret = -1;
+		the_dir->tail_block = 0;
+		the_dir->tail_offset = 0;
+		entry_dirty(file_index);
+	}
+	put_io_buff(buf);
+
+	unlock_frags();
+	return ret;
+}
+
+
+// helper: tail packing, copy len bytes into the first fragment block with a
+// long enough run of free units, or a new one, and return where they went
+static int frag_store(const char *data, size_t len, int *block, int *offset)
+{
+	int units = (len + FRAG_UNIT - 1) / FRAG_UNIT;
+	uint64_t run = units == 64 ? UINT64_MAX : ((uint64_t)1 << units) - 1;
+	uint64_t used = 1;
+	int unit = -1;
+
+	*block = -1;
+	for (int i = 0; i < num_frag_blocks && unit < 0; i++) {
+		for (int u = 1; u + units <= FRAG_UNITS; u++) {
+			if (!(frag_blocks[i].used & run << u)) {
+				*block = frag_blocks[i].block;
+				used = frag_blocks[i].used;
+				unit = u;
+				break;
+			}
+		}
+	}
+
+	char *buf = get_io_buff();
+	if (!buf)
+		return -1;
+	if (*block < 0) {
+		if ((*block = alloc_node(0)) < 0) {
+			put_io_buff(buf);
+			return -1;
+		}
+		memset(buf, 0, BLOCK_SIZE);
+		unit = 1;
+	} else if (cache_read(*block + vol.data_start_index, buf) < 0) {
+		put_io_buff(buf);
+		return -1;
+	}
+
+	used |= run << unit;
+	memcpy(buf, &used, sizeof(used));
+	memcpy(buf + unit * FRAG_UNIT, data, len);
+	int ret = cache_write(*block + vol.data_start_index, buf);
+	put_io_buff(buf);
+	if (ret < 0)
+		return -1;
+
+	*offset = unit * FRAG_UNIT;
+	frag_remember(*block, used);
+	return 0;
+}
+
+
+// helper: tail packing, give back the units of a tail, and the fragment
+// block itself once it holds no tail anymore
+static int frag_free(int block, int offset, size_t len)
+{
+	int units = (len + FRAG_UNIT - 1) / FRAG_UNIT;
+	uint64_t run = units == 64 ? UINT64_MAX : ((uint64_t)1 << units) - 1;
+	char *buf = get_io_buff();
+	uint64_t used;
+
+	if (!buf || cache_read(block + vol.data_start_index, buf) < 0) {
+		put_io_buff(buf);
+		return -1;
+	}
+	memcpy(&used, buf, sizeof(used));
+	used &= ~(run << (offset / FRAG_UNIT));
+
+	int ret = 0;
+	if (used == 1) {
+		release_block(block);
+	} else {
+		memcpy(buf, &used, sizeof(used));
+		ret = cache_write(block + vol.data_start_index, buf);
+	}
+	put_io_buff(buf);
+	frag_remember(block, used);
+	return ret;
+}
+
+
+// helper: tail packing, keep track of the fragment blocks with the most room
+static void frag_remember(int block, uint64_t used)
+{
+	int i = 0;
+
+	while (i < num_frag_blocks && frag_blocks[i].block != block)
+		i++;
+
+	// a freed fragment block or a full one is of no more use
+	if (used == 1 || used == UINT64_MAX) {
+		if (i < num_frag_blocks)
+			frag_blocks[i] = frag_blocks[--num_frag_blocks];
+		return;
+	}
+
+	if (i == num_frag_blocks) {
+		if (num_frag_blocks < FRAG_CACHE_SIZE) {
+			num_frag_blocks++;
+		} else {
+			// replace the fullest one, if fuller than this one
+			i = 0;
+			for (int j = 1; j < FRAG_CACHE_SIZE; j++)
+				if (__builtin_popcountll(frag_blocks[j].used) >
+				    __builtin_popcountll(frag_blocks[i].used))
+					i = j;
+			if (__builtin_popcountll(frag_blocks[i].used) <= __builtin_popcountll(used))
+				return;
+		}
+	}
+	frag_blocks[i].block = block;
+	frag_blocks[i].used = used;
+}
+
+
+// helper: tail packing, one thread at a time in the fragment blocks
+static void lock_frags(void)
+{
+	while (frags_busy)
+		uthread_yield();
+	frags_busy = true;
+}
+
+
+static void unlock_frags(void)
+{
+	frags_busy = false;
+}
+
+
+// helper: write, whether a file's data can live in its root directory entry:
+// it already does, or the file is empty
+static bool can_inline(int file_index)
+{
+	struct rootdirectory_t *the_dir = file_entry(file_index);
+
+	if (!vol.inline_data || file_index >= FS_FILE_MAX_COUNT)
+		return false;
+	if (the_dir->flags & ENTRY_INLINE)
+		return true;
+	return the_dir->file_size == 0 && get_start_block(file_index) == EOC &&
+	       !staged[file_index];
+}
+
+
+// helper: write, move the inline data of a file to a data block of its own
+static int spill_inline(int file_index)
+{
+	struct rootdirectory_t *the_dir = file_entry(file_index);
+	int ret = 0;
+
+	// one thread at a time moving file data around
+	lock_frags();
+	if (!(the_dir->flags & ENTRY_INLINE)) {
+		unlock_frags();
+		return 0;
+	}
+
+	char *buf = get_io_buff();
+	if (!buf || load_free_map() < 0) {
+		ret = -1;
+	} else if (the_dir->file_size == 0) {
+		the_dir->flags &= ~ENTRY_INLINE;
+	} else if ((size_t)num_free_blocks <= num_staged_blocks) {
+		fs_error("no free block left");
+		ret = -1;
+	} else if (extend_chain(file_index, EOC, 0, 1) != 1) {
+		ret = -1;
+	} else {
+		memset(buf, 0, BLOCK_SIZE);
+		memcpy(buf, root_inline[file_index], the_dir->file_size);
+		the_dir->flags &= ~ENTRY_INLINE;
+		if (cache_write(get_start_block(file_index) + vol.data_start_index, buf) < 0)
+			ret = -1;
+	}
+	root_dir_dirty = true;
+	put_io_buff(buf);
+
+	unlock_frags();
+	return ret;
+}
+
+
+// helper: readdir, the entries of a subdirectory past the last one returned:
+// from the leaf that would hold it, then along the leaf list
+static int dir_read(struct dir_stream_t *ds, struct fs_dirent *entries, int count)
+{
+	struct dir_node_t *node;
+	bool found;
+	int n = 0;
+
+	if (ds->done || count == 0)
+		return 0;
+	if (!(node = (struct dir_node_t *)get_io_buff()))
+		return -1;
+
+	if (dir_descend(ds->dir, ds->last, node) < 0) {
+		put_io_buff((char *)node);
+		return -1;
+	}
+	int pos = leaf_find(node, ds->last, &found);
+	if (found)
+		pos++;
+
+	for (;;) {
+		for (; pos < node->num && n < count; pos++) {
+			// an open file's entry may be ahead of its copy in the tree
+			int slot = sub_slot(ds->dir, node->entries[pos].filename);
+			fill_dirent(&entries[n++], slot >= 0 ? &open_files[slot]->entry
+			                                     : &node->entries[pos]);
+		}
+		if (n == count)
+			break;
+		if (node->link == 0) {
+			ds->done = true;
+			break;
+		}
+		// what was read so far is returned, the rest is tried again next time
+		if (read_node(node->link, node) < 0) {
+			if (n == 0)
+				n = -1;
+			break;
+		}
+		pos = 0;
+	}
+	put_io_buff((char *)node);
+
+	if (n > 0)
+		memcpy(ds->last, entries[n - 1].name, FS_FILENAME_LEN);
+	return n;
+}
+
+
+// helper: readdir, an entry as the application sees it
+static void fill_dirent(struct fs_dirent *dirent, const struct rootdirectory_t *entry)
+{
+	int start = entry_start(entry);
+
+	memcpy(dirent->name, entry->filename, FS_FILENAME_LEN);
+	dirent->name[FS_FILENAME_LEN - 1] = '\0';
+	dirent->is_dir = entry->type == ENTRY_DIR;
+	dirent->size = dirent->is_dir ? 0 : entry->file_size;
+	dirent->first_block = start == EOC ? disk_EOC() : (uint32_t)start;
+}
+
+
+// helper: rmdir, whether a directory is being listed
+static bool dir_listed(int dir)
+{
+	for (int dd = 0; dd < FS_OPEN_MAX_COUNT; dd++)
+		if (dir_streams[dd].is_used && dir_streams[dd].dir == dir)
+			return true;
+	return false;
+}
@@ -1,6 +1,8 @@
 #ifndef _FS_H
 #define _FS_H
 
+#include <stddef.h>
+#include <sys/uio.h>
 #include <stdint.h>
 
 /** Maximum filename length (including the NULL character) */
@@ -9,9 +11,39 @@
 /** Maximum number of files in the root directory */
 #define FS_FILE_MAX_COUNT 128
 
-/** Maximum number of open files */
+/** Number of file descriptors available before the descriptor table grows */
 #define FS_OPEN_MAX_COUNT 32
 
+/** Use 32-bit FAT entries and block numbers, for volumes past 65535 blocks */
+#define FS_FORMAT_FAT32 0x1
+
+/** Keep the data of tiny files of the root directory in their entry */
+#define FS_FORMAT_INLINE 0x2
+
+/**
+ * fs_format - Create a file system
+ * @diskname: Name of the virtual disk file
+ * @data_blocks: Number of data blocks
+ * @flags: Bitwise OR of %FS_FORMAT_* options, or 0
+ *
+ * Create virtual disk file @diskname, sized for @data_blocks data blocks plus
+ * the metadata, and write an empty file system to it. By default the original
+ * format is used, whose 16-bit FAT entries limit the disk to 65535 blocks
+ * (256 MiB). With %FS_FORMAT_FAT32, FAT entries and block numbers are 32-bit
+ * wide; such a file system can only be mounted by implementations that know
+ * format version 1.
+ *
+ * With %FS_FORMAT_INLINE, the root directory takes a second block that widens
+ * each entry by 32 bytes. Files of the root directory that are at most 32 bytes
+ * long keep their data there instead of in a data block: opening and reading
+ * them takes no disk access past the mount, and they use no FAT entry. A file
+ * moves to a data block as soon as it grows larger.
+ *
+ * Return: -1 if @data_blocks is 0 or too large for the format, if a file
+ * system is currently mounted, or if @diskname cannot be created. 0 otherwise.
+ */
+int fs_format(const char *diskname, size_t data_blocks, int flags);
+
 /**
  * fs_mount - Mount a file system
  * @diskname: Name of the virtual disk file
@@ -25,6 +57,62 @@
  */
 int fs_mount(const char *diskname);
 
+/** Access the virtual disk through a memory mapping instead of read/write */
+#define FS_MOUNT_MMAP 0x1
+
+/** Issue disk I/O asynchronously, letting other threads run meanwhile */
+#define FS_MOUNT_ASYNC 0x2
+
+/** Read FAT blocks on first use instead of at mount time */
+#define FS_MOUNT_LAZY 0x4
+
+/** Give disk blocks to appended data when it is flushed rather than written */
+#define FS_MOUNT_DELALLOC 0x8
+
+/** Pack the partial last blocks of small files together in shared blocks */
+#define FS_MOUNT_TAILPACK 0x10
+
+/**
+ * fs_mount_ex - Mount a file system with options
+ * @diskname: Name of the virtual disk file
+ * @flags: Bitwise OR of %FS_MOUNT_* options, or 0
+ *
+ * Same as fs_mount(), which is equivalent to fs_mount_ex(@diskname, 0). With
+ * %FS_MOUNT_MMAP, the virtual disk file is memory-mapped so that block accesses
+ * are plain memory copies; the block cache is bypassed in that mode since it
+ * would only add another copy.
+ *
+ * With %FS_MOUNT_ASYNC, disk transfers are submitted through io_uring: a thread
+ * reading or writing a file is blocked while its blocks are in flight, and the
+ * scheduler keeps running the other ready threads, so that the I/O of many
+ * concurrent readers overlaps. Without io_uring support, this flag is ignored.
+ *
+ * With %FS_MOUNT_LAZY, only the superblock and the root directory are read at
+ * mount time. Each FAT block is read the first time a file's chain reaches it,
+ * and the whole FAT is read when free space is first needed (growing a file,
+ * fs_info(), fs_frag_stats()). Short sessions that only look at a few files
+ * then read as much metadata as they use, whatever the size of the volume.
+ *
+ * With %FS_MOUNT_DELALLOC, data appended to a file is kept in memory against
+ * its logical block numbers, with as many free blocks set aside, and only gets
+ * disk blocks when the file is closed, at fs_sync(), or once too much data is
+ * held. All the pending blocks of a file are then allocated in one batch, so
+ * that files written at the same time by several threads are each stored in
+ * one piece instead of interleaved.
+ *
+ * With %FS_MOUNT_TAILPACK, when the last descriptor on a file is closed, the
+ * partial last block of the file, if at most half a block long, is moved into a
+ * fragment block shared with the tails of other files, in units of 64 bytes,
+ * and its own block is given back. A 100-byte file then takes 128 bytes of disk
+ * instead of a whole block. The tail moves back to a block of its own when the
+ * file is next written to. Packed tails are read whether this flag is set or
+ * not.
+ *
+ * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
+ * file system can be located. 0 otherwise.
+ */
+int fs_mount_ex(const char *diskname, int flags);
+
 /**
  * fs_umount - Unmount file system
  *
@@ -36,27 +124,73 @@ int fs_mount(const char *diskname);
  */
 int fs_umount(void);
 
+/**
+ * fs_sync - Write pending changes to the virtual disk
+ *
+ * Write out the write buffers of open descriptors (see %FS_OPEN_WBUF) and the
+ * cached data blocks, then the metadata blocks (FAT blocks, root directory,
+ * superblock) modified since the last synchronization. Unchanged metadata
+ * blocks are not rewritten, so a session that only read files writes nothing.
+ * fs_umount() performs the same synchronization.
+ *
+ * Return: -1 if no underlying virtual disk was opened, or if a block cannot be
+ * written. 0 otherwise.
+ */
+int fs_sync(void);
+
 /**
  * fs_info - Display information about file system
  *
- * Display some information about the currently mounted file system.
+ * Display some information about the currently mounted file system, as
+ * reported by fs_volume_stats().
  *
  * Return: -1 if no underlying virtual disk was opened. 0 otherwise.
  */
 int fs_info(void);
 
+/*
+ * struct fs_volume_stats - Layout and occupancy of a file system
+ * @total_blocks: Number of blocks of the virtual disk
+ * @fat_blocks: Number of blocks of the FAT
+ * @root_dir_block: Index of the first root directory block
+ * @data_start: Index of the first data block
+ * @data_blocks: Number of data blocks
+ * @free_blocks: Number of free data blocks
+ * @free_root_entries: Number of free entries in the root directory
+ */
+struct fs_volume_stats {
+	size_t total_blocks;
+	size_t fat_blocks;
+	size_t root_dir_block;
+	size_t data_start;
+	size_t data_blocks;
+	size_t free_blocks;
+	size_t free_root_entries;
+};
+
+/**
+ * fs_volume_stats - Get the layout and occupancy of the file system
+ * @stats: Structure to be filled with the figures that fs_info() displays
+ *
+ * Return: -1 if no underlying virtual disk was opened or if @stats is NULL. 0
+ * otherwise.
+ */
+int fs_volume_stats(struct fs_volume_stats *stats);
+
 /**
  * fs_create - Create a new file
  * @filename: File name
  *
- * Create a new and empty file named @filename in the root directory of the
- * mounted file system. String @filename must be NULL-terminated and its total
- * length cannot exceed %FS_FILENAME_LEN characters (including the NULL
- * character).
+ * Create a new and empty file named @filename in the mounted file system.
+ * String @filename must be NULL-terminated. It is a path: names separated by
+ * '/', all but the last one being directories, starting from the root
+ * directory whether @filename begins with '/' or not. Each name cannot exceed
+ * %FS_FILENAME_LEN characters (including the NULL character).
  *
- * Return: -1 if a file named @filename already exists, or if string @filename
- * is too long, or if the root directory already contains %FS_FILE_MAX_COUNT
- * files. 0 otherwise.
+ * Return: -1 if a file named @filename already exists, or if a name in
+ * @filename is too long, or if a directory of the path does not exist, or if
+ * the file goes in the root directory and it already contains
+ * %FS_FILE_MAX_COUNT files. 0 otherwise.
  */
 int fs_create(const char *filename);
 
@@ -64,51 +198,193 @@ int fs_create(const char *filename);
  * fs_delete - Delete a file
  * @filename: File name
  *
- * Delete the file named @filename from the root directory of the mounted file
- * system.
+ * Delete the file named @filename (a path, as for fs_create()) from the mounted
+ * file system.
  *
- * Return: -1 if there is no file named @filename to delete, or if file
- * @filename is currently open. 0 otherwise.
+ * Return: -1 if there is no file named @filename to delete, or if @filename is
+ * a directory, or if file @filename is currently open. 0 otherwise.
  */
 int fs_delete(const char *filename);
 
+/**
+ * fs_mkdir - Create a directory
+ * @dirname: Directory name
+ *
+ * Create a new and empty directory named @dirname (a path, as for fs_create()).
+ * Unlike the root directory, the number of files in a directory is only
+ * bounded by the free space of the disk: its entries are kept in a B+tree of
+ * data blocks ordered by name, so that finding a file reads one block per
+ * level of the tree however many files the directory holds.
+ *
+ * Return: -1 if a file named @dirname already exists, if a directory of the
+ * path does not exist, or if there is no room left for it. 0 otherwise.
+ */
+int fs_mkdir(const char *dirname);
+
+/**
+ * fs_rmdir - Remove a directory
+ * @dirname: Directory name
+ *
+ * Remove the empty directory named @dirname (a path, as for fs_create()).
+ *
+ * Return: -1 if there is no directory named @dirname, or if it is not empty.
+ * 0 otherwise.
+ */
+int fs_rmdir(const char *dirname);
+
 /**
  * fs_ls - List files on file system
  *
- * List information about the files located in the root directory.
+ * List information about the files and directories located in the root
+ * directory, as returned by fs_readdir().
  *
  * Return: -1 if no underlying virtual disk was opened. 0 otherwise.
  */
 int fs_ls(void);
 
+/*
+ * struct fs_dirent - Directory entry
+ * @name: Name of the file or directory, NULL-terminated
+ * @size: Size of the file in bytes, 0 for a directory
+ * @first_block: First data block of the file, or root block of the
+ * directory. For an empty file, the end-of-chain marker of the FAT: 0xFFFF, or
+ * 0xFFFFFFFF with %FS_FORMAT_FAT32.
+ * @is_dir: 1 for a directory, 0 for a file
+ */
+struct fs_dirent {
+	char     name[FS_FILENAME_LEN];
+	size_t   size;
+	uint32_t first_block;
+	int      is_dir;
+};
+
+/**
+ * fs_opendir - Open a directory for listing
+ * @dirname: Path of the directory, "/" (or "") for the root directory
+ *
+ * Return a directory handle to pass to fs_readdir() and fs_readdir_bulk(). Up
+ * to %FS_OPEN_MAX_COUNT directories can be open for listing at the same time,
+ * and fs_rmdir() refuses to remove one of them.
+ *
+ * Return: -1 if no underlying virtual disk was opened, if @dirname is not a
+ * directory, or if there are already %FS_OPEN_MAX_COUNT directories open.
+ * Otherwise the directory handle.
+ */
+int fs_opendir(const char *dirname);
+
+/**
+ * fs_readdir - Read the next entry of a directory
+ * @dd: Directory handle
+ * @entry: Structure to be filled with the entry
+ *
+ * Root directory entries come in their slot order, subdirectory entries in
+ * name order. Entries created or removed while the directory is listed may or
+ * may not be returned, but no entry is returned twice.
+ *
+ * Return: -1 if @dd is invalid or if the directory cannot be read. 0 once
+ * every entry was returned. 1 otherwise.
+ */
+int fs_readdir(int dd, struct fs_dirent *entry);
+
+/**
+ * fs_readdir_bulk - Read the next entries of a directory
+ * @dd: Directory handle
+ * @entries: Array to be filled with the entries
+ * @count: Number of entries of @entries
+ *
+ * Same as fs_readdir(), for up to @count entries at a time. A subdirectory
+ * walk then resumes where it stopped once per call rather than once per entry.
+ *
+ * Return: -1 if @dd is invalid or if the directory cannot be read. Otherwise
+ * the number of entries filled, 0 once every entry was returned.
+ */
+int fs_readdir_bulk(int dd, struct fs_dirent *entries, int count);
+
+/**
+ * fs_closedir - Close a directory handle
+ * @dd: Directory handle
+ *
+ * Return: -1 if @dd is invalid. 0 otherwise.
+ */
+int fs_closedir(int dd);
+
 /**
  * fs_open - Open a file
  * @filename: File name
  *
- * Open file named @filename for reading and writing, and return the
- * corresponding file descriptor. The file descriptor is a non-negative integer
- * that is used subsequently to access the contents of the file. The file offset
- * of the file descriptor is set to 0 initially (beginning of the file). If the
+ * Open file named @filename (a path, as for fs_create()) for reading and
+ * writing, and return the corresponding file descriptor. The file descriptor is
+ * a non-negative integer that is used subsequently to access the contents of
+ * the file. The file offset of the file descriptor is set to 0 initially
+ * (beginning of the file). If the
  * same file is opened multiple files, fs_open() must return distinct file
- * descriptors. A maximum of %FS_OPEN_MAX_COUNT files can be open
- * simultaneously.
+ * descriptors, which share the state of the open file. There is no fixed limit
+ * on the number of open descriptors: the descriptor table starts with
+ * %FS_OPEN_MAX_COUNT of them and doubles whenever they are all in use. Closed
+ * descriptors are reused.
  *
- * Return: -1 if there is no file named @filename to open, or if there are
- * already %FS_OPEN_MAX_COUNT files currently open. 0 otherwise.
+ * Return: -1 if there is no file named @filename to open, or if no memory is
+ * left for a descriptor. 0 otherwise.
  */
 int fs_open(const char *filename);
 
+/** Descriptor mostly seeks around the file instead of streaming through it */
+#define FS_OPEN_RANDOM 0x1
+
+/** Descriptor buffers small writes and hands them to the file a block at a time */
+#define FS_OPEN_WBUF 0x2
+
+/**
+ * fs_open_ex - Open a file with options
+ * @filename: File name
+ * @flags: Bitwise OR of %FS_OPEN_* options, or 0
+ *
+ * Same as fs_open(), which is equivalent to fs_open_ex(@filename, 0).
+ *
+ * With %FS_OPEN_RANDOM, the first non-sequential access through the descriptor
+ * builds an in-memory map from the file's logical blocks to its data blocks, so
+ * that later accesses at any offset locate their block without following the
+ * FAT chain. The map is shared by every descriptor open on the same file, and
+ * dropped when the file's chain changes or the file is deleted.
+ *
+ * With %FS_OPEN_WBUF, fs_write() calls of less than a block through the
+ * descriptor are appended to a one-block buffer, which is written to the file
+ * once it reaches the end of a block, or when fs_flush(), fs_close(),
+ * fs_lseek() or fs_sync() is called; any other read or write through the
+ * descriptor flushes it first. Buffered bytes count in fs_stat() for the
+ * descriptor but are not seen by other descriptors until flushed. Running out
+ * of disk space is only detected at flush time, where the unwritten bytes are
+ * reported as an error and dropped.
+ *
+ * Return: -1 if there is no file named @filename to open, or if no memory is
+ * left for a descriptor. Otherwise the file descriptor.
+ */
+int fs_open_ex(const char *filename, int flags);
+
 /**
  * fs_close - Close a file
  * @fd: File descriptor
  *
- * Close file descriptor @fd.
+ * Close file descriptor @fd, after writing out its buffered data if any.
  *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
- * open). 0 otherwise.
+ * open), or if its buffered data could not all be written (the descriptor is
+ * closed anyway). 0 otherwise.
  */
 int fs_close(int fd);
 
+/**
+ * fs_flush - Write out buffered data
+ * @fd: File descriptor
+ *
+ * Write the bytes held in the write buffer of file descriptor @fd (see
+ * %FS_OPEN_WBUF) to the file. Does nothing for other descriptors.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), or if the buffered bytes could not all be written. 0 otherwise.
+ */
+int fs_flush(int fd);
+
 /**
  * fs_stat - Get file status
  * @fd: File descriptor
@@ -152,7 +428,8 @@ int fs_lseek(int fd, size_t offset);
  * smaller than @count (it can even be 0 if there is no more space on disk).
  *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
- * open). Otherwise return the number of bytes actually written.
+ * open), or if a block partially overwritten by the data could not be read.
+ * Otherwise return the number of bytes actually written.
  */
 int fs_write(int fd, void *buf, size_t count);
 
@@ -176,4 +453,142 @@ int fs_write(int fd, void *buf, size_t count);
  */
 int fs_read(int fd, void *buf, size_t count);
 
+/**
+ * fs_pwrite - Write to a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ * @offset: File offset at which to write
+ *
+ * Same as fs_write(), except that the data is written at @offset and the file
+ * offset of @fd is neither used nor changed. Threads sharing a descriptor can
+ * therefore write to different parts of the file without coordinating.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), or if @offset is out of bounds (beyond the end of the file). Otherwise
+ * return the number of bytes actually written.
+ */
+int fs_pwrite(int fd, void *buf, size_t count, size_t offset);
+
+/**
+ * fs_pread - Read from a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ * @offset: File offset from which to read
+ *
+ * Same as fs_read(), except that the data is read from @offset and the file
+ * offset of @fd is neither used nor changed. Threads sharing a descriptor can
+ * therefore read from different parts of the file without coordinating.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open). Otherwise return the number of bytes actually read, 0 if @offset is at
+ * or beyond the end of the file.
+ */
+int fs_pread(int fd, void *buf, size_t count, size_t offset);
+
+/**
+ * fs_writev - Write to a file from several buffers
+ * @fd: File descriptor
+ * @iov: Array of buffers to write in the file, in order
+ * @iovcnt: Number of entries in @iov
+ *
+ * Same as fs_write(), with the data taken from the @iovcnt buffers described
+ * by @iov one after the other, as if they had first been concatenated. Each
+ * block of the file is assembled directly from the buffers and written once.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open). Otherwise return the number of bytes actually written.
+ */
+int fs_writev(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * fs_readv - Read from a file into several buffers
+ * @fd: File descriptor
+ * @iov: Array of buffers to be filled with data, in order
+ * @iovcnt: Number of entries in @iov
+ *
+ * Same as fs_read(), with the data spread over the @iovcnt buffers described
+ * by @iov, filling each one before moving on to the next.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open). Otherwise return the number of bytes actually read.
+ */
+int fs_readv(int fd, const struct iovec *iov, int iovcnt);
+
+/*
+ * struct fs_frag_stats - Fragmentation report
+ * @free_blocks: Number of free data blocks
+ * @free_extents: Number of maximal runs of contiguous free data blocks
+ * @largest_free_extent: Length, in blocks, of the longest free run
+ * @file_blocks: Number of data blocks used by files
+ * @file_extents: Number of contiguous runs the files are split into (a file
+ * stored in one piece counts as one)
+ */
+struct fs_frag_stats {
+	size_t free_blocks;
+	size_t free_extents;
+	size_t largest_free_extent;
+	size_t file_blocks;
+	size_t file_extents;
+};
+
+/**
+ * fs_frag_stats - Report free space and file fragmentation
+ * @stats: Structure to be filled with the report
+ *
+ * Return: -1 if no underlying virtual disk was opened or if @stats is NULL. 0
+ * otherwise.
+ */
+int fs_frag_stats(struct fs_frag_stats *stats);
+
+/*
+ * struct fs_cache_stats - Block cache counters
+ * @hits: Number of data block accesses served from memory
+ * @misses: Number of data block accesses that went to the virtual disk
+ * @evictions: Number of cached blocks recycled to make room for other blocks
+ * @writebacks: Number of dirty blocks written back to the virtual disk
+ * @readahead_blocks: Number of blocks prefetched for sequential readers
+ * @readahead_hits: Number of prefetched blocks that were read afterwards
+ * @readahead_unused: Number of prefetched blocks evicted before being read
+ */
+struct fs_cache_stats {
+	size_t hits;
+	size_t misses;
+	size_t evictions;
+	size_t writebacks;
+	size_t readahead_blocks;
+	size_t readahead_hits;
+	size_t readahead_unused;
+};
+
+/**
+ * fs_cache_config - Configure the block cache size
+ * @nblocks: Number of data blocks to keep in memory
+ *
+ * Set the size of the write-back block cache that sits between the file system
+ * and the virtual disk. The new size takes effect at the next fs_mount(). A
+ * size of 0 disables caching. Dirty blocks are written back when evicted and
+ * at fs_umount() at the latest.
+ *
+ * The cache also holds the readahead of sequential readers: as long as each
+ * fs_read() through a descriptor starts where the previous one ended, the
+ * blocks following the data read are prefetched, 4 blocks ahead at first and
+ * twice as many with every read that continues the stream, up to 32 blocks or
+ * half the cache. Any other access drops the window, and descriptors opened
+ * with %FS_OPEN_RANDOM never prefetch. Without a cache, there is no readahead.
+ *
+ * Return: -1 if a file system is currently mounted. 0 otherwise.
+ */
+int fs_cache_config(size_t nblocks);
+
+/**
+ * fs_cache_stats - Get block cache counters
+ * @stats: Structure to be filled with the counters of the current (or last)
+ * mount
+ *
+ * Return: -1 if @stats is NULL. 0 otherwise.
+ */
+int fs_cache_stats(struct fs_cache_stats *stats);
+
 #endif /* _FS_H */
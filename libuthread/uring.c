@@ -0,0 +1,283 @@
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define _UTHREAD_PRIVATE
+#include "uring.h"
+#include "uthread.h"
+
+#define uring_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* One request waiting for its completion */
+struct uring_req {
+	/* Thread to wake up, NULL outside of the thread system */
+	struct uthread_tcb *waiter;
+	/* Waiter is blocked, request completed */
+	int parked, done;
+	/* Completion result: byte count or negative errno */
+	int res;
+};
+
+/* io_uring instance description */
+struct uring {
+	int fd;
+	/* Submission ring */
+	void *sq_ring;
+	size_t sq_ring_size;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_entries, *sq_array;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	/* Completion ring */
+	void *cq_ring;
+	size_t cq_ring_size;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	/* Requests queued in the ring but not yet handed to the kernel */
+	unsigned to_submit;
+	/* Requests queued or in flight */
+	unsigned pending;
+};
+
+/* Ring instance (invalid by default) */
+static struct uring ring = { .fd = -1 };
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(unsigned to_submit, unsigned min_complete,
+			      unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, ring.fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+int uring_init(unsigned entries)
+{
+	struct io_uring_params p;
+	char *sq, *cq;
+
+	if (ring.fd != -1) {
+		uring_error("ring already set up");
+		return -1;
+	}
+
+	memset(&p, 0, sizeof(p));
+	if ((ring.fd = sys_io_uring_setup(entries, &p)) < 0) {
+		ring.fd = -1;
+		return -1;
+	}
+
+	ring.sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring.cq_ring_size = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	ring.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	ring.sq_ring = mmap(NULL, ring.sq_ring_size, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_POPULATE, ring.fd,
+			    IORING_OFF_SQ_RING);
+	ring.cq_ring = mmap(NULL, ring.cq_ring_size, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_POPULATE, ring.fd,
+			    IORING_OFF_CQ_RING);
+	ring.sqes = mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+	if (ring.sq_ring == MAP_FAILED || ring.cq_ring == MAP_FAILED ||
+	    ring.sqes == MAP_FAILED) {
+		perror("mmap");
+		if (ring.sq_ring != MAP_FAILED)
+			munmap(ring.sq_ring, ring.sq_ring_size);
+		if (ring.cq_ring != MAP_FAILED)
+			munmap(ring.cq_ring, ring.cq_ring_size);
+		if (ring.sqes != MAP_FAILED)
+			munmap(ring.sqes, ring.sqes_size);
+		close(ring.fd);
+		ring.fd = -1;
+		return -1;
+	}
+
+	sq = ring.sq_ring;
+	ring.sq_head = (unsigned *)(sq + p.sq_off.head);
+	ring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	ring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	ring.sq_entries = (unsigned *)(sq + p.sq_off.ring_entries);
+	ring.sq_array = (unsigned *)(sq + p.sq_off.array);
+
+	cq = ring.cq_ring;
+	ring.cq_head = (unsigned *)(cq + p.cq_off.head);
+	ring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	ring.cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	ring.to_submit = 0;
+	ring.pending = 0;
+
+	return 0;
+}
+
+void uring_exit(void)
+{
+	if (ring.fd == -1)
+		return;
+
+	while (ring.pending)
+		uring_poll(1);
+
+	munmap(ring.sq_ring, ring.sq_ring_size);
+	munmap(ring.cq_ring, ring.cq_ring_size);
+	munmap(ring.sqes, ring.sqes_size);
+	close(ring.fd);
+	ring.fd = -1;
+}
+
+/* Record the result of a request and wake up its thread */
+static void complete(struct uring_req *req, int res)
+{
+	req->res = res;
+	req->done = 1;
+	if (req->parked)
+		uthread_unblock(req->waiter);
+	ring.pending--;
+}
+
+/*
+ * Take back the requests the kernel has not consumed yet and complete them
+ * with error @err. Requests already handed over complete normally.
+ */
+static void fail_queued(int err)
+{
+	unsigned head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+	unsigned tail = *ring.sq_tail;
+
+	__atomic_store_n(ring.sq_tail, head, __ATOMIC_RELEASE);
+	ring.to_submit = 0;
+
+	for (; head != tail; head++) {
+		struct io_uring_sqe *sqe =
+			&ring.sqes[ring.sq_array[head & *ring.sq_mask]];
+
+		complete((void *)(uintptr_t)sqe->user_data, err);
+	}
+}
+
+/*
+ * Hand queued requests to the kernel, optionally waiting for completions. If
+ * the kernel refuses them, they fail rather than staying queued forever.
+ */
+static int submit(unsigned min_complete)
+{
+	unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+	int ret;
+
+	if (!ring.to_submit && !min_complete)
+		return 0;
+
+	do {
+		ret = sys_io_uring_enter(ring.to_submit, min_complete, flags);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0) {
+		int err = errno;
+
+		perror("io_uring_enter");
+		fail_queued(-err);
+		errno = err;
+		return -1;
+	}
+
+	ring.to_submit -= ret < (int)ring.to_submit ? ret : ring.to_submit;
+	return 0;
+}
+
+int uring_poll(int wait)
+{
+	unsigned head;
+	int reaped = 0;
+
+	if (ring.fd == -1 || !ring.pending)
+		return 0;
+
+	/* A failed submission completes its requests, reap the others anyway */
+	head = *ring.cq_head;
+	if (head == __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE))
+		submit(wait ? 1 : 0);
+
+	while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+
+		complete((void *)(uintptr_t)cqe->user_data, cqe->res);
+		head++;
+		reaped++;
+	}
+	__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+	return reaped;
+}
+
+int uring_pending(void)
+{
+	return ring.fd == -1 ? 0 : ring.pending;
+}
+
+ssize_t uring_rw(int write_op, int fd, const struct iovec *iov, int iovcnt,
+		 off_t offset)
+{
+	struct uring_req req = { .waiter = uthread_running() ? uthread_current() : NULL };
+	struct io_uring_sqe *sqe;
+	unsigned tail;
+
+	if (ring.fd == -1) {
+		uring_error("ring not set up");
+		errno = ENXIO;
+		return -1;
+	}
+
+	/* Make room in the submission ring */
+	tail = *ring.sq_tail;
+	while (tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) >=
+	       *ring.sq_entries) {
+		if (submit(0) < 0) {
+			errno = EIO;
+			return -1;
+		}
+	}
+
+	sqe = &ring.sqes[tail & *ring.sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = write_op ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)iov;
+	sqe->len = iovcnt;
+	sqe->off = offset;
+	sqe->user_data = (uintptr_t)&req;
+
+	ring.sq_array[tail & *ring.sq_mask] = tail & *ring.sq_mask;
+	__atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring.to_submit++;
+	ring.pending++;
+
+	/*
+	 * Let the scheduler run other threads; the idle loop submits the batch
+	 * and wakes us up. Without a scheduler, complete the request right now.
+	 */
+	while (!req.done) {
+		if (req.waiter) {
+			req.parked = 1;
+			uthread_block();
+			req.parked = 0;
+		} else {
+			uring_poll(1);
+		}
+	}
+
+	if (req.res < 0) {
+		errno = -req.res;
+		return -1;
+	}
+	return req.res;
+}
@@ -0,0 +1,70 @@
+#ifndef _URING_H
+#define _URING_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#ifdef _UTHREAD_PRIVATE
+
+/** Number of submission queue entries of the ring */
+#define URING_ENTRIES 64
+
+/**
+ * uring_init - Set up the io_uring instance
+ * @entries: Size of the submission queue
+ *
+ * Return: -1 if the ring is already set up or if the kernel does not support
+ * io_uring. 0 otherwise.
+ */
+int uring_init(unsigned entries);
+
+/**
+ * uring_exit - Tear down the io_uring instance
+ *
+ * Wait for all in-flight requests to complete before releasing the ring.
+ */
+void uring_exit(void);
+
+/**
+ * uring_rw - Perform a positional vectored transfer through the ring
+ * @write_op: Non-zero for a write, zero for a read
+ * @fd: File descriptor to transfer from or to
+ * @iov: Array of buffers
+ * @iovcnt: Number of entries in @iov
+ * @offset: Byte offset in @fd
+ *
+ * Queue the request in the ring. When called from a uthread, the calling
+ * thread is parked with uthread_block() until the request completes, letting
+ * the scheduler run other ready threads in the meantime; queued requests are
+ * handed to the kernel in batches by uring_poll(). Outside of the thread
+ * system, the request is submitted and waited for right away.
+ *
+ * Return: -1 (with errno set) if the transfer fails. Otherwise the number of
+ * bytes transferred, which can be smaller than requested.
+ */
+ssize_t uring_rw(int write_op, int fd, const struct iovec *iov, int iovcnt,
+		 off_t offset);
+
+/**
+ * uring_pending - Count the requests not yet completed
+ *
+ * Return: Number of queued or in-flight requests, 0 if the ring is not set up.
+ */
+int uring_pending(void);
+
+/**
+ * uring_poll - Submit queued requests and reap completions
+ * @wait: Sleep in the kernel until at least one request completes
+ *
+ * Every reaped completion unblocks the uthread waiting on it. If the kernel
+ * refuses the submission, the queued requests complete with its error code.
+ *
+ * Return: Number of completions reaped.
+ */
+int uring_poll(int wait);
+
+#else
+#error "Private header, can't be included from applications directly"
+#endif
+
+#endif /* _URING_H */
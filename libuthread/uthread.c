@@ -9,12 +9,14 @@
 #define _UTHREAD_PRIVATE
 #include "context.h"
 #include "queue.h"
+#include "uring.h"
 #include "uthread.h"
 
 // global access array (all threads)
 // note: semaphore_queue always contains blocked ppl
 queue_t queue, semaphore_queue;		
 struct uthread_tcb* curThread, *cur_sem_thread;
+struct uthread_tcb* idleThread;
 int thread_id = 0;
 sigset_t SavedMask;					
 
@@ -42,6 +44,14 @@ struct uthread_tcb *uthread_current(void)
 }
 
 
+int uthread_running(void)
+{
+	// the idle thread only runs the scheduler loop, and is left
+	// current once uthread_start() returns
+	return idleThread && curThread && curThread != idleThread;
+}
+
+
 void uthread_yield(void)
 {
 	// save current state
@@ -192,13 +202,20 @@ void uthread_start(uthread_func_t start, void *arg)
 
 	// set current thread to
 	curThread = idle_thread;
+	idleThread = idle_thread;
 
 	if(uthread_create(start, arg) == -1) {
 		fprintf(stderr, "Error: fail to create idle_thread.\n");
 		return ;
 	}
 
-	// set idle 
-	while(queue_length(queue) != 0) 
-		uthread_yield();
+	// set idle: keep going while threads are ready or parked on block I/O,
+	// only sleeping in the kernel when nothing else can run
+	while(queue_length(queue) != 0 || uring_pending() != 0) {
+		if (uring_pending() != 0)
+			uring_poll(queue_length(queue) == 0);
+		if (queue_length(queue) != 0)
+			uthread_yield();
+	}
+	idleThread = NULL;
 }
\ No newline at end of file
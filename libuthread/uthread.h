@@ -83,6 +83,14 @@ struct uthread_tcb;
  */
 struct uthread_tcb *uthread_current(void);
 
+/*
+ * uthread_running - Check whether the scheduler can switch away from the caller
+ *
+ * Return: 1 if called from a thread while uthread_start() is running its
+ * scheduler loop, 0 from the idle thread or outside of the thread system
+ */
+int uthread_running(void);
+
 /*
  * uthread_block - Block currently running thread
  */
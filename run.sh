@@ -285,6 +285,244 @@ echo -e "\n\n";
 echo "Testing Completed to Driver size 4";
 
 
+#------------------------------------------------------------------------
+
+
+echo -e "\n\n";
+echo "Creating Virtual Disk of size 8192";
+rm our_driver ref_driver;
+./fs.x make our_driver 8192;
+./fs.x make ref_driver 8192;
+
+
+echo -e "\n\n";
+echo "Testing piecewise large file addition";
+./test-fs.x padd our_driver shakespeare.txt 1000 > our_add.txt;
+./fs.x add ref_driver shakespeare.txt > ref_add.txt;
+diff our_add.txt ref_add.txt;
+rm ref_add.txt our_add.txt;
+
+
+echo -e "\n\n";
+echo "Testing piecewise large file read";
+./test-fs.x pcat our_driver shakespeare.txt 700 > our_read.txt;
+./fs.x cat ref_driver shakespeare.txt > ref_read.txt;
+diff our_read.txt ref_read.txt;
+rm our_read.txt ref_read.txt;
+
+
+echo -e "\n\n";
+echo "Testing delayed allocation small file addition";
+./test-fs.x -m delalloc padd our_driver file1.txt 5 > our_add.txt;
+./fs.x add ref_driver file1.txt > ref_add.txt;
+diff our_add.txt ref_add.txt;
+rm ref_add.txt our_add.txt;
+
+
+echo -e "\n\n";
+echo "Testing asynchronous delayed allocation small file addition";
+./test-fs.x -m async,delalloc add our_driver file2.txt > our_add.txt;
+./fs.x add ref_driver file2.txt > ref_add.txt;
+diff our_add.txt ref_add.txt;
+rm ref_add.txt our_add.txt;
+
+
+echo -e "\n\n";
+echo "Testing reference read of our disk";
+for f in shakespeare.txt file1.txt file2.txt; do
+	./fs.x cat our_driver $f > our_read.txt;
+	./fs.x cat ref_driver $f > ref_read.txt;
+	diff our_read.txt ref_read.txt;
+	rm our_read.txt ref_read.txt;
+done
+
+
+echo -e "\n\n";
+echo "Testing reference info of our disk";
+./fs.x info our_driver > our_info.txt;
+./fs.x info ref_driver > ref_info.txt;
+diff our_info.txt ref_info.txt;
+rm our_info.txt ref_info.txt;
+
+
+echo -e "\n\n";
+echo "Testing shared file descriptors";
+./test-fs.x share our_driver shakespeare.txt 100 > our_share.txt;
+./test-fs.x stat our_driver shakespeare.txt >> our_share.txt;
+echo "Shared file 'shakespeare.txt' between 100 descriptors (44406/44406 bytes)" > ref_share.txt;
+echo "Size of file 'shakespeare.txt' is 44407 bytes" >> ref_share.txt;
+diff our_share.txt ref_share.txt;
+rm our_share.txt ref_share.txt;
+
+
+echo -e "\n\n";
+echo "Testing subdirectories";
+mkdir -p dir/sub;
+cp file3.txt dir/sub;
+cp shakespeare.txt dir;
+./test-fs.x mkdir our_driver dir > our_dir.txt;
+./test-fs.x mkdir our_driver dir/sub >> our_dir.txt;
+./test-fs.x add our_driver dir/sub/file3.txt >> our_dir.txt;
+./test-fs.x add our_driver dir/shakespeare.txt >> our_dir.txt;
+./test-fs.x ls our_driver dir >> our_dir.txt;
+./test-fs.x ls our_driver dir/sub >> our_dir.txt;
+./test-fs.x cat our_driver dir/sub/file3.txt >> our_dir.txt;
+./test-fs.x cat our_driver dir/shakespeare.txt > our_read.txt;
+./test-fs.x rmdir our_driver dir/sub 2> /dev/null >> our_dir.txt;
+./test-fs.x rm our_driver dir/sub/file3.txt >> our_dir.txt;
+./test-fs.x rmdir our_driver dir/sub >> our_dir.txt;
+./test-fs.x ls our_driver dir >> our_dir.txt;
+cat > ref_dir.txt << EOT
+Created directory 'dir'
+Created directory 'dir/sub'
+Wrote file 'dir/sub/file3.txt' (42/42 bytes)
+Wrote file 'dir/shakespeare.txt' (44406/44406 bytes)
+file: shakespeare.txt, size: 44406
+dir: sub
+file: file3.txt, size: 42
+Read file 'dir/sub/file3.txt' (42/42 bytes)
+Content of the file:
+$(cat file3.txt)
+Removed file 'dir/sub/file3.txt'
+Removed directory 'dir/sub'
+file: shakespeare.txt, size: 44406
+EOT
+echo "Read file 'dir/shakespeare.txt' (44406/44406 bytes)" > ref_read.txt;
+echo "Content of the file:" >> ref_read.txt;
+cat shakespeare.txt >> ref_read.txt;
+diff our_dir.txt ref_dir.txt;
+diff our_read.txt ref_read.txt;
+rm our_dir.txt ref_dir.txt our_read.txt ref_read.txt;
+rm -r dir;
+
+
+echo -e "\n\n";
+echo "Testing Completed to Driver size 8192 with new features";
+
+
+#------------------------------------------------------------------------
+
+
+echo -e "\n\n";
+echo "Creating Virtual Disk of size 100";
+rm our_driver ref_driver;
+./fs.x make our_driver 100;
+./fs.x make ref_driver 100;
+
+
+echo -e "\n\n";
+echo "Testing tail packed file addition";
+for f in file1.txt file2.txt file3.txt shakespeare.txt; do
+	./test-fs.x -m tailpack add our_driver $f > our_add.txt;
+	./fs.x add ref_driver $f > ref_add.txt;
+	diff our_add.txt ref_add.txt;
+	rm ref_add.txt our_add.txt;
+done
+
+
+echo -e "\n\n";
+echo "Testing tail packed file read";
+for f in file1.txt file2.txt file3.txt shakespeare.txt; do
+	./test-fs.x pcat our_driver $f 500 > our_read.txt;
+	./fs.x cat ref_driver $f > ref_read.txt;
+	diff our_read.txt ref_read.txt;
+	rm our_read.txt ref_read.txt;
+done
+
+
+echo -e "\n\n";
+echo "Testing tail packed file rewrite";
+./test-fs.x -m tailpack rm our_driver file2.txt > our_rm.txt;
+./test-fs.x -m tailpack padd our_driver file2.txt 10 >> our_rm.txt;
+./test-fs.x cat our_driver file2.txt >> our_rm.txt;
+./fs.x rm ref_driver file2.txt > ref_rm.txt;
+./fs.x add ref_driver file2.txt >> ref_rm.txt;
+./fs.x cat ref_driver file2.txt >> ref_rm.txt;
+diff our_rm.txt ref_rm.txt;
+rm our_rm.txt ref_rm.txt;
+
+
+echo -e "\n\n";
+echo "Testing tail packed file removal";
+for f in file1.txt file2.txt file3.txt shakespeare.txt; do
+	./test-fs.x -m tailpack rm our_driver $f > /dev/null;
+done
+./test-fs.x info our_driver > our_info.txt;
+./fs.x make ref_empty 100 > /dev/null;
+./fs.x info ref_empty > ref_info.txt;
+diff our_info.txt ref_info.txt;
+rm our_info.txt ref_info.txt ref_empty;
+
+
+echo -e "\n\n";
+echo "Testing Completed to Driver size 100 with tail packing";
+
+
+#------------------------------------------------------------------------
+
+
+echo -e "\n\n";
+echo "Creating Virtual Disk of size 100 with inline data";
+rm our_driver ref_driver;
+./test-fs.x make our_driver 100 inline;
+printf 'tiny\n' > tiny.txt;
+
+
+echo -e "\n\n";
+echo "Testing inline file addition and spill";
+./test-fs.x padd our_driver tiny.txt > our_inline.txt;
+./test-fs.x info our_driver >> our_inline.txt;
+./test-fs.x padd our_driver file1.txt 20 >> our_inline.txt;
+./test-fs.x info our_driver >> our_inline.txt;
+./test-fs.x cat our_driver tiny.txt >> our_inline.txt;
+./test-fs.x pcat our_driver file1.txt 7 >> our_inline.txt;
+./test-fs.x rm our_driver tiny.txt >> our_inline.txt;
+./test-fs.x rm our_driver file1.txt >> our_inline.txt;
+./test-fs.x info our_driver >> our_inline.txt;
+cat > ref_inline.txt << EOT
+Wrote file 'tiny.txt' (5/5 bytes)
+FS Info:
+total_blk_count=104
+fat_blk_count=1
+rdir_blk=2
+data_blk=4
+data_blk_count=100
+fat_free_ratio=99/100
+rdir_free_ratio=127/128
+Wrote file 'file1.txt' (33/33 bytes)
+FS Info:
+total_blk_count=104
+fat_blk_count=1
+rdir_blk=2
+data_blk=4
+data_blk_count=100
+fat_free_ratio=98/100
+rdir_free_ratio=126/128
+Read file 'tiny.txt' (5/5 bytes)
+Content of the file:
+tiny
+Read file 'file1.txt' (33/33 bytes)
+Content of the file:
+$(cat file1.txt)
+Removed file 'tiny.txt'
+Removed file 'file1.txt'
+FS Info:
+total_blk_count=104
+fat_blk_count=1
+rdir_blk=2
+data_blk=4
+data_blk_count=100
+fat_free_ratio=99/100
+rdir_free_ratio=128/128
+EOT
+diff our_inline.txt ref_inline.txt;
+rm our_inline.txt ref_inline.txt tiny.txt our_driver;
+
+
+echo -e "\n\n";
+echo "Testing Completed to Driver size 100 with inline data";
+
+
 #	make
 #	info
 #	ls
@@ -5,6 +5,7 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include <uthread.h>
@@ -33,6 +34,50 @@ struct thread_arg {
 	char **argv;
 };
 
+/* Mount options of every command, see -m in usage() */
+static int mount_flags = FS_MOUNT_LAZY;
+
+static struct {
+	const char *name;
+	int flag;
+} mount_options[] = {
+	{ "mmap",	FS_MOUNT_MMAP },
+	{ "async",	FS_MOUNT_ASYNC },
+	{ "delalloc",	FS_MOUNT_DELALLOC },
+	{ "tailpack",	FS_MOUNT_TAILPACK },
+};
+
+/* Chunk size of the commands reading or writing a file piecewise */
+#define DEFAULT_CHUNK 1000
+
+void thread_fs_make(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	size_t data_blocks;
+	int flags = 0;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <data block count> [fat32] [inline]");
+
+	diskname = t_arg->argv[0];
+	data_blocks = strtoul(t_arg->argv[1], NULL, 0);
+	for (int i = 2; i < t_arg->argc; i++) {
+		if (!strcmp(t_arg->argv[i], "fat32"))
+			flags |= FS_FORMAT_FAT32;
+		else if (!strcmp(t_arg->argv[i], "inline"))
+			flags |= FS_FORMAT_INLINE;
+		else
+			die("Unknown format '%s'", t_arg->argv[i]);
+	}
+
+	if (fs_format(diskname, data_blocks, flags))
+		die("Cannot create diskname");
+
+	printf("Created virtual disk '%s' with '%zu' data blocks\n", diskname,
+	       data_blocks);
+}
+
 void thread_fs_stat(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -46,7 +91,7 @@ void thread_fs_stat(void *arg)
 	diskname = t_arg->argv[0];
 	filename = t_arg->argv[1];
 
-	if (fs_mount(diskname))
+	if (fs_mount_ex(diskname, mount_flags))
 		die("Cannot mount diskname");
 
 	fs_fd = fs_open(filename);
@@ -90,7 +135,7 @@ void thread_fs_cat(void *arg)
 	diskname = t_arg->argv[0];
 	filename = t_arg->argv[1];
 
-	if (fs_mount(diskname))
+	if (fs_mount_ex(diskname, mount_flags))
 		die("Cannot mount diskname");
 
 	fs_fd = fs_open(filename);
@@ -143,7 +188,7 @@ void thread_fs_rm(void *arg)
 	diskname = t_arg->argv[0];
 	filename = t_arg->argv[1];
 
-	if (fs_mount(diskname))
+	if (fs_mount_ex(diskname, mount_flags))
 		die("Cannot mount diskname");
 
 	if (fs_delete(filename)) {
@@ -157,6 +202,56 @@ void thread_fs_rm(void *arg)
 	printf("Removed file '%s'\n", filename);
 }
 
+void thread_fs_mkdir(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *dirname;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <dirname>");
+
+	diskname = t_arg->argv[0];
+	dirname = t_arg->argv[1];
+
+	if (fs_mount_ex(diskname, mount_flags))
+		die("Cannot mount diskname");
+
+	if (fs_mkdir(dirname)) {
+		fs_umount();
+		die("Cannot create directory");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Created directory '%s'\n", dirname);
+}
+
+void thread_fs_rmdir(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *dirname;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <dirname>");
+
+	diskname = t_arg->argv[0];
+	dirname = t_arg->argv[1];
+
+	if (fs_mount_ex(diskname, mount_flags))
+		die("Cannot mount diskname");
+
+	if (fs_rmdir(dirname)) {
+		fs_umount();
+		die("Cannot remove directory");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Removed directory '%s'\n", dirname);
+}
+
 void thread_fs_add(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -189,7 +284,7 @@ void thread_fs_add(void *arg)
 	 * - mount, create a new file, copy content of host file into this new
 	 *   file, close the new file, and umount
 	 */
-	if (fs_mount(diskname))
+	if (fs_mount_ex(diskname, mount_flags))
 		die("Cannot mount diskname");
 
 	if (fs_create(filename)) {
@@ -223,17 +318,33 @@ void thread_fs_add(void *arg)
 void thread_fs_ls(void *arg)
 {
 	struct thread_arg *t_arg = arg;
+	struct fs_dirent entry;
 	char *diskname;
+	int dd, ret;
 
 	if (t_arg->argc < 1)
-		die("Usage: <diskname> <filename>");
+		die("Usage: <diskname> [<dirname>]");
 
 	diskname = t_arg->argv[0];
 
-	if (fs_mount(diskname))
+	if (fs_mount_ex(diskname, mount_flags))
 		die("Cannot mount diskname");
 
-	fs_ls();
+	if (t_arg->argc < 2) {
+		fs_ls();
+	} else {
+		if ((dd = fs_opendir(t_arg->argv[1])) < 0)
+			die("Cannot open directory");
+		while ((ret = fs_readdir(dd, &entry)) > 0) {
+			if (entry.is_dir)
+				printf("dir: %s\n", entry.name);
+			else
+				printf("file: %s, size: %zu\n", entry.name, entry.size);
+		}
+		fs_closedir(dd);
+		if (ret < 0)
+			die("Cannot read directory");
+	}
 
 	if (fs_umount())
 		die("Cannot unmount diskname");
@@ -249,7 +360,7 @@ void thread_fs_info(void *arg)
 
 	diskname = t_arg->argv[0];
 
-	if (fs_mount(diskname))
+	if (fs_mount_ex(diskname, mount_flags))
 		die("Cannot mount diskname");
 
 	fs_info();
@@ -258,25 +369,347 @@ void thread_fs_info(void *arg)
 		die("Cannot unmount diskname");
 }
 
+void thread_fs_frag(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_frag_stats stats;
+	char *diskname;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	diskname = t_arg->argv[0];
+
+	if (fs_mount_ex(diskname, mount_flags))
+		die("Cannot mount diskname");
+
+	if (fs_frag_stats(&stats)) {
+		fs_umount();
+		die("Cannot get fragmentation report");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("free_blk_count=%zu\n", stats.free_blocks);
+	printf("free_extent_count=%zu\n", stats.free_extents);
+	printf("largest_free_extent=%zu\n", stats.largest_free_extent);
+	printf("file_blk_count=%zu\n", stats.file_blocks);
+	printf("file_extent_count=%zu\n", stats.file_extents);
+}
+
+/*
+ * Same as add, with the file written chunk by chunk, each one in turn through
+ * small buffered writes, fs_pwrite() or fs_writev() on separate descriptors
+ */
+void thread_fs_padd(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename, *buf;
+	int fd, wbuf_fd, fs_fd;
+	struct stat st;
+	size_t chunk, written = 0;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <host filename> [<chunk size>]");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+	chunk = t_arg->argc > 2 ? strtoul(t_arg->argv[2], NULL, 0) : DEFAULT_CHUNK;
+	if (!chunk)
+		die("Invalid chunk size");
+
+	/* Open file on host computer */
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		die_perror("open");
+	if (fstat(fd, &st))
+		die_perror("fstat");
+	if (!S_ISREG(st.st_mode))
+		die("Not a regular file: %s\n", filename);
+
+	buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (buf == MAP_FAILED)
+		die_perror("mmap");
+
+	if (fs_mount_ex(diskname, mount_flags))
+		die("Cannot mount diskname");
+
+	if (fs_create(filename)) {
+		fs_umount();
+		die("Cannot create file");
+	}
+
+	wbuf_fd = fs_open_ex(filename, FS_OPEN_WBUF);
+	fs_fd = fs_open(filename);
+	if (wbuf_fd < 0 || fs_fd < 0) {
+		fs_umount();
+		die("Cannot open file");
+	}
+
+	for (size_t i = 0; written < (size_t)st.st_size; i++) {
+		size_t len = st.st_size - written;
+		char *src = buf + written;
+		int ret = 0;
+
+		if (len > chunk)
+			len = chunk;
+
+		switch (i % 3) {
+		case 0: {
+			/* Pieces of a tenth of the chunk, gathered by the buffer */
+			size_t done = 0, piece = chunk / 10 + 1;
+			if (fs_lseek(wbuf_fd, written))
+				break;
+			while (done < len) {
+				size_t n = len - done < piece ? len - done : piece;
+				if (fs_write(wbuf_fd, src + done, n) != (int)n)
+					break;
+				done += n;
+			}
+			if (fs_flush(wbuf_fd) == 0)
+				ret = done;
+			break;
+		}
+		case 1:
+			ret = fs_pwrite(fs_fd, src, len, written);
+			break;
+		case 2: {
+			/* Three uneven pieces */
+			struct iovec iov[3] = {
+				{ src, len / 4 },
+				{ src + len / 4, len / 2 },
+				{ src + len / 4 + len / 2, len - len / 4 - len / 2 },
+			};
+			if (fs_lseek(fs_fd, written) == 0)
+				ret = fs_writev(fs_fd, iov, 3);
+			break;
+		}
+		}
+		if (ret <= 0)
+			break;
+		written += ret;
+	}
+
+	if (fs_close(wbuf_fd) || fs_close(fs_fd)) {
+		fs_umount();
+		die("Cannot close file");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Wrote file '%s' (%zu/%zu bytes)\n", filename, written,
+	       st.st_size);
+
+	munmap(buf, st.st_size);
+	close(fd);
+}
+
+/*
+ * Same as cat, with the file read chunk by chunk from the end, each one in
+ * turn through fs_pread() or fs_readv() on separate descriptors
+ */
+void thread_fs_pcat(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename, *buf;
+	int pread_fd, fs_fd;
+	size_t chunk, stat, read = 0;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <filename> [<chunk size>]");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+	chunk = t_arg->argc > 2 ? strtoul(t_arg->argv[2], NULL, 0) : DEFAULT_CHUNK;
+	if (!chunk)
+		die("Invalid chunk size");
+
+	if (fs_mount_ex(diskname, mount_flags))
+		die("Cannot mount diskname");
+
+	pread_fd = fs_open_ex(filename, FS_OPEN_RANDOM);
+	fs_fd = fs_open(filename);
+	if (pread_fd < 0 || fs_fd < 0) {
+		fs_umount();
+		die("Cannot open file");
+	}
+
+	stat = fs_stat(fs_fd);
+	if (!stat) {
+		/* Nothing to read, file is empty */
+		printf("Empty file\n");
+		return;
+	}
+	buf = calloc(1, stat + 1);
+	if (!buf) {
+		perror("malloc");
+		fs_umount();
+		die("Cannot malloc");
+	}
+
+	for (size_t i = 0, end = stat; end > 0; i++) {
+		size_t offset = end > chunk ? end - chunk : 0;
+		size_t len = end - offset;
+		char *dst = buf + offset;
+		int ret = -1;
+
+		if (i % 2 == 0) {
+			ret = fs_pread(pread_fd, dst, len, offset);
+		} else {
+			/* Three uneven pieces */
+			struct iovec iov[3] = {
+				{ dst, len / 2 },
+				{ dst + len / 2, len / 3 },
+				{ dst + len / 2 + len / 3, len - len / 2 - len / 3 },
+			};
+			if (fs_lseek(fs_fd, offset) == 0)
+				ret = fs_readv(fs_fd, iov, 3);
+		}
+		if (ret != (int)len)
+			break;
+		read += len;
+		end = offset;
+	}
+
+	if (fs_close(pread_fd) || fs_close(fs_fd)) {
+		fs_umount();
+		die("Cannot close file");
+	}
+
+	if (fs_umount())
+		die("cannot unmount diskname");
+
+	printf("Read file '%s' (%zu/%zu bytes)\n", filename, read, stat);
+	printf("Content of the file:\n%s", buf);
+
+	free(buf);
+}
+
+/*
+ * Open a file through many descriptors at once and read it through all of them
+ * in turn, a block each, then append to it through the last one
+ */
+void thread_fs_share(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename, *buf, *block;
+	int count, *fds;
+	size_t stat, read = 0;
+
+	if (t_arg->argc < 3)
+		die("need <diskname> <filename> <descriptor count>");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+	count = atoi(t_arg->argv[2]);
+	if (count < 1)
+		die("Invalid descriptor count");
+
+	if (fs_mount_ex(diskname, mount_flags))
+		die("Cannot mount diskname");
+
+	fds = malloc(count * sizeof(*fds));
+	block = malloc(4096);
+	if (!fds || !block) {
+		fs_umount();
+		die("Cannot malloc");
+	}
+	for (int i = 0; i < count; i++) {
+		if ((fds[i] = fs_open(filename)) < 0) {
+			fs_umount();
+			die("Cannot open file %d times", i + 1);
+		}
+	}
+
+	stat = fs_stat(fds[0]);
+	buf = malloc(stat + 1);
+	if (!buf) {
+		fs_umount();
+		die("Cannot malloc");
+	}
+
+	/* A block per descriptor in turn, each one keeps its own offset */
+	for (int eof = 0; eof < count; ) {
+		eof = 0;
+		for (int i = 0; i < count; i++) {
+			int ret = fs_read(fds[i], block, 4096);
+			if (ret < 0 || read + (i ? 0 : ret) > stat) {
+				fs_umount();
+				die("Cannot read file");
+			}
+			if (!ret) {
+				eof++;
+			} else if (i == 0) {
+				memcpy(buf + read, block, ret);
+				read += ret;
+			} else if (memcmp(block, buf + read - ret, ret)) {
+				fs_umount();
+				die("Descriptor %d reads different data", fds[i]);
+			}
+		}
+	}
+
+	/* An append through one descriptor shows through all of them */
+	if (fs_lseek(fds[count - 1], stat) || fs_write(fds[count - 1], "\n", 1) != 1) {
+		fs_umount();
+		die("Cannot append to file");
+	}
+	for (int i = 0; i < count; i++) {
+		if ((size_t)fs_stat(fds[i]) != stat + 1) {
+			fs_umount();
+			die("Descriptor %d sees the old size", i);
+		}
+	}
+
+	for (int i = 0; i < count; i++) {
+		if (fs_close(fds[i])) {
+			fs_umount();
+			die("Cannot close file");
+		}
+	}
+
+	if (fs_umount())
+		die("cannot unmount diskname");
+
+	printf("Shared file '%s' between %d descriptors (%zu/%zu bytes)\n",
+	       filename, count, read, stat);
+
+	free(buf);
+	free(block);
+	free(fds);
+}
+
 static struct {
 	const char *name;
 	uthread_func_t func;
 } commands[] = {
+	{ "make",	thread_fs_make },
 	{ "info",	thread_fs_info },
 	{ "ls",		thread_fs_ls },
 	{ "add",	thread_fs_add },
 	{ "rm",		thread_fs_rm },
 	{ "cat",	thread_fs_cat },
 	{ "stat",	thread_fs_stat },
+	{ "mkdir",	thread_fs_mkdir },
+	{ "rmdir",	thread_fs_rmdir },
+	{ "frag",	thread_fs_frag },
+	{ "padd",	thread_fs_padd },
+	{ "pcat",	thread_fs_pcat },
+	{ "share",	thread_fs_share },
 };
 
 void usage(void)
 {
 	int i;
-	fprintf(stderr, "Usage: test-fs <command> [<arg>]\n");
+	fprintf(stderr, "Usage: test-fs [-m <option>[,<option>...]] <command> [<arg>]\n");
 	fprintf(stderr, "Possible commands are:\n");
 	for (i = 0; i < ARRAY_SIZE(commands); i++)
 		fprintf(stderr, "\t%s\n", commands[i].name);
+	fprintf(stderr, "Possible mount options are:\n");
+	for (i = 0; i < ARRAY_SIZE(mount_options); i++)
+		fprintf(stderr, "\t%s\n", mount_options[i].name);
 	exit(1);
 }
 
@@ -290,6 +723,22 @@ int main(int argc, char **argv)
 	argc--;
 	argv++;
 
+	/* Mount options, for every command */
+	if (argc >= 2 && !strcmp(argv[0], "-m")) {
+		for (char *opt = strtok(argv[1], ","); opt; opt = strtok(NULL, ",")) {
+			for (i = 0; i < ARRAY_SIZE(mount_options); i++)
+				if (!strcmp(opt, mount_options[i].name))
+					break;
+			if (i == ARRAY_SIZE(mount_options)) {
+				test_fs_error("invalid mount option '%s'", opt);
+				usage();
+			}
+			mount_flags |= mount_options[i].flag;
+		}
+		argc -= 2;
+		argv += 2;
+	}
+
 	if (!argc)
 		usage();
 